@@ -0,0 +1,87 @@
+/*
+ * AIM color_math_check
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// compares color_math against the float/division expressions dxt5 decoding used before,
+// for all 256x256 channel pairs; returns non zero on any difference
+
+#include <color.h>
+
+#include <iostream>
+#include <stdint.h>
+#include <string>
+
+// uint8_t(a * m + b * (1 - m)) in float with every operation rounded on its own:
+// each step is exact in double and then rounded to float once, so neither fma contraction
+// nor excess precision can change the result, whatever flags this file is built with
+static uint8_t float_lerp(int a, int b, float m)
+{
+    float x = (float)((double)a * m);
+    float n = (float)(1.0 - (double)m);
+    float y = (float)((double)b * n);
+    return (uint8_t)(float)((double)x + (double)y);
+}
+
+// integer sums are exact in double, the division is correctly rounded, no contraction is possible
+static uint8_t double_ramp(int i, int n, int a, int b)
+{
+    return (uint8_t)(double((n - i) * a + i * b) / double(n));
+}
+
+static int check(const std::string &name, int (*f)(int a, int b))
+{
+    int errors = 0;
+    for (int a = 0; a < 256; a++)
+    {
+        for (int b = 0; b < 256; b++)
+            errors += f(a, b);
+    }
+    std::cout << name << ": " << (errors ? std::to_string(errors) + " mismatches" : "ok") << "\n";
+    return errors;
+}
+
+int main()
+{
+    int errors = 0;
+    errors += check("lerp_2_3", [](int a, int b)
+    {
+        return int(color_math::lerp_2_3(a, b) != float_lerp(a, b, 2.f / 3.f));
+    });
+    errors += check("lerp_1_3", [](int a, int b)
+    {
+        return int(color_math::lerp_1_3(a, b) != float_lerp(a, b, 1.f / 3.f));
+    });
+    errors += check("lerp_1_2", [](int a, int b)
+    {
+        return int(color_math::lerp_1_2(a, b) != float_lerp(a, b, 1.f / 2.f));
+    });
+    errors += check("alpha_ramp7", [](int a, int b)
+    {
+        int e = 0;
+        for (int i = 1; i < 7; i++)
+            e += color_math::alpha_ramp7(i, a, b) != double_ramp(i, 7, a, b);
+        return e;
+    });
+    errors += check("alpha_ramp5", [](int a, int b)
+    {
+        int e = 0;
+        for (int i = 1; i < 5; i++)
+            e += color_math::alpha_ramp5(i, a, b) != double_ramp(i, 5, a, b);
+        return e;
+    });
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * AIM tools
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "color.h"
+#include "dxt5.h"
+#include "mat.h"
+#include "parallel.h"
+#include "simd.h"
+
+// BC3 (DXT5) encoder, the counterpart of dxt5_block::decode()
+// indices are always chosen against the decoder tables, so the result decodes exactly as measured
+struct bc3_encoder
+{
+    enum class quality
+    {
+        fast, // bounding box endpoints
+        high, // cluster fit along the principal axis, alpha tries both modes
+    };
+
+    quality q = quality::fast;
+
+    bc3_encoder(quality q = quality::fast) : q(q) {}
+
+    // 4x4 pixels from src, rows are stride pixels apart
+    dxt5_block encodeBlock(const color *src, ptrdiff_t stride) const
+    {
+        color px[16];
+        for (int row = 0; row < 4; row++)
+        {
+            for (int col = 0; col < 4; col++)
+                px[row * 4 + col] = src[row * stride + col];
+        }
+
+        dxt5_block b;
+        b.alpha_part = 0;
+        b.color_part = 0;
+        if (q == quality::high)
+        {
+            encodeAlphaHigh(b, px);
+            encodeColorHigh(b, px);
+        }
+        else
+        {
+            encodeAlphaFast(b, px);
+            encodeColorFast(b, px);
+        }
+        return b;
+    }
+
+    // image rows are top-down, blocks are returned in row-major order
+    // partial blocks on the right and bottom edges repeat the edge pixels
+    std::vector<dxt5_block> encode(mat_view<const uint32_t> image) const
+    {
+        int w = image.getWidth();
+        int h = image.getHeight();
+        int bw = std::max(1, (w + 3) / 4);
+        int bh = std::max(1, (h + 3) / 4);
+        std::vector<dxt5_block> blocks(bw * bh);
+        if (!w || !h)
+            return blocks;
+        parallel_for(bh, [this, &image, &blocks, w, h, bw](size_t by)
+        {
+            color px[16];
+            for (int bx = 0; bx < bw; bx++)
+            {
+                const color *src;
+                ptrdiff_t stride;
+                if ((int)by * 4 + 4 <= h && bx * 4 + 4 <= w)
+                {
+                    src = (const color *)&image(by * 4, bx * 4);
+                    stride = image.getStride() / (ptrdiff_t)sizeof(uint32_t);
+                }
+                else
+                {
+                    for (int row = 0; row < 4; row++)
+                    {
+                        for (int col = 0; col < 4; col++)
+                            px[row * 4 + col] = *(const color *)&image(std::min<int>(by * 4 + row, h - 1), std::min(bx * 4 + col, w - 1));
+                    }
+                    src = px;
+                    stride = 4;
+                }
+                blocks[by * bw + bx] = encodeBlock(src, stride);
+            }
+        });
+        return blocks;
+    }
+
+    // psnr of the decoded blocks against the image over all four channels, in dB
+    // infinity when they are identical
+    static double psnr(mat_view<const uint32_t> image, const std::vector<dxt5_block> &blocks)
+    {
+        int w = image.getWidth();
+        int h = image.getHeight();
+        int bw = std::max(1, (w + 3) / 4);
+        int bh = std::max(1, (h + 3) / 4);
+        if (!w || !h || blocks.size() < (size_t)bw * bh)
+            return 0;
+        std::vector<uint64_t> errors(bh);
+        parallel_for(bh, [&image, &blocks, &errors, w, h, bw](size_t by)
+        {
+            uint64_t e = 0;
+            color px[16];
+            for (int bx = 0; bx < bw; bx++)
+            {
+                blocks[by * bw + bx].decode(px, 4);
+                for (int row = 0; row < 4 && by * 4 + row < (size_t)h; row++)
+                {
+                    for (int col = 0; col < 4 && bx * 4 + col < w; col++)
+                    {
+                        auto &p = *(const color *)&image(by * 4 + row, bx * 4 + col);
+                        for (int i = 0; i < 4; i++)
+                        {
+                            int d = p.byte[i] - px[row * 4 + col].byte[i];
+                            e += d * d;
+                        }
+                    }
+                }
+            }
+            errors[by] = e;
+        });
+        uint64_t e = 0;
+        for (auto v : errors)
+            e += v;
+        if (!e)
+            return INFINITY;
+        double mse = (double)e / ((double)w * h * 4);
+        return 10 * log10(255.0 * 255.0 / mse);
+    }
+
+    static color_rgb565 to_rgb565(int r, int g, int b)
+    {
+        return ((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255);
+    }
+
+private:
+    static int encodeAlphaFast(dxt5_block &b, const color *px)
+    {
+        // a[0] > a[1] selects the 8 value mode
+        uint8_t amin = 255, amax = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            amin = std::min(amin, px[i].a);
+            amax = std::max(amax, px[i].a);
+        }
+        b.a[0] = amax;
+        b.a[1] = amin;
+        return amin != amax ? selectAlphaIndices(b, px) : 0;
+    }
+
+    // 8 value mode with min/max endpoints, or 6 value mode with min/max of the values other than 0 and 255
+    static void encodeAlphaHigh(dxt5_block &b, const color *px)
+    {
+        auto e8 = encodeAlphaFast(b, px);
+        if (e8 == 0)
+            return;
+
+        uint8_t amin = 255, amax = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            if (px[i].a == 0 || px[i].a == 255)
+                continue;
+            amin = std::min(amin, px[i].a);
+            amax = std::max(amax, px[i].a);
+        }
+        if (amin > amax)
+            amin = amax = 0;
+        dxt5_block b6;
+        b6.alpha_part = 0;
+        b6.a[0] = amin;
+        b6.a[1] = amax;
+        if (selectAlphaIndices(b6, px) < e8)
+            b.alpha_part = b6.alpha_part;
+    }
+
+    static int encodeColorFast(dxt5_block &b, const color *px)
+    {
+        uint8_t lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+        for (int p = 0; p < 16; p++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                lo[i] = std::min(lo[i], px[p].byte[i]);
+                hi[i] = std::max(hi[i], px[p].byte[i]);
+            }
+        }
+        // inset the box a bit, the extremes are usually outliers
+        for (int i = 0; i < 3; i++)
+        {
+            int inset = (hi[i] - lo[i]) / 16;
+            lo[i] += inset;
+            hi[i] -= inset;
+        }
+        // pick the box diagonal: green and red run against blue when their covariance with it is negative
+        int cov[3] = { 0 };
+        for (int p = 0; p < 16; p++)
+        {
+            int db = px[p].b - (lo[0] + hi[0]) / 2;
+            for (int i = 1; i < 3; i++)
+                cov[i] += db * (px[p].byte[i] - (lo[i] + hi[i]) / 2);
+        }
+        for (int i = 1; i < 3; i++)
+        {
+            if (cov[i] < 0)
+                std::swap(lo[i], hi[i]);
+        }
+        setColorEndpoints(b, to_rgb565(hi[2], hi[1], hi[0]), to_rgb565(lo[2], lo[1], lo[0]));
+        return selectColorIndices(b, px);
+    }
+
+    // squish style cluster fit: pixels are ordered along the principal axis and every split
+    // into the 4 palette entries is solved by least squares, the best quantized result is kept
+    static void encodeColorHigh(dxt5_block &b, const color *px)
+    {
+        auto best_error = encodeColorFast(b, px);
+        if (best_error == 0)
+            return;
+
+        float mean[3] = { 0 };
+        for (int p = 0; p < 16; p++)
+        {
+            for (int i = 0; i < 3; i++)
+                mean[i] += px[p].byte[i] / 16.f;
+        }
+        float cov[6] = { 0 }; // xx xy xz yy yz zz
+        for (int p = 0; p < 16; p++)
+        {
+            float d[3];
+            for (int i = 0; i < 3; i++)
+                d[i] = px[p].byte[i] - mean[i];
+            cov[0] += d[0] * d[0];
+            cov[1] += d[0] * d[1];
+            cov[2] += d[0] * d[2];
+            cov[3] += d[1] * d[1];
+            cov[4] += d[1] * d[2];
+            cov[5] += d[2] * d[2];
+        }
+        // power iteration
+        float axis[3] = { 1, 1, 1 };
+        for (int k = 0; k < 8; k++)
+        {
+            float v[3] =
+            {
+                cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2],
+            };
+            float m = std::max({ fabsf(v[0]), fabsf(v[1]), fabsf(v[2]) });
+            if (m == 0)
+                return;
+            for (int i = 0; i < 3; i++)
+                axis[i] = v[i] / m;
+        }
+
+        int order[16];
+        float dots[16];
+        for (int p = 0; p < 16; p++)
+        {
+            order[p] = p;
+            dots[p] = px[p].byte[0] * axis[0] + px[p].byte[1] * axis[1] + px[p].byte[2] * axis[2];
+        }
+        std::sort(order, order + 16, [&dots](int a, int b) { return dots[a] > dots[b]; });
+
+        // prefix sums of the ordered points
+        float sums[17][3] = { 0 };
+        for (int p = 0; p < 16; p++)
+        {
+            for (int i = 0; i < 3; i++)
+                sums[p + 1][i] = sums[p][i] + px[order[p]].byte[i];
+        }
+
+        // clusters [0, i0) [i0, i1) [i1, i2) [i2, 16) get weights 1, 2/3, 1/3, 0 of the first endpoint
+        // splits are compared by their least squares residual, only the best one is quantized
+        float best_residual = INFINITY;
+        float best_e0[3], best_e1[3];
+        for (int i0 = 0; i0 <= 16; i0++)
+        {
+            for (int i1 = i0; i1 <= 16; i1++)
+            {
+                for (int i2 = i1; i2 <= 16; i2++)
+                {
+                    float n0 = i0, n1 = i1 - i0, n2 = i2 - i1, n3 = 16 - i2;
+                    float aa = n0 + n1 * 4 / 9.f + n2 * 1 / 9.f;
+                    float bb = n3 + n2 * 4 / 9.f + n1 * 1 / 9.f;
+                    float ab = (n1 + n2) * 2 / 9.f;
+                    float det = aa * bb - ab * ab;
+                    if (fabsf(det) < 1e-6f)
+                        continue;
+                    // residual is sum(x^2) - (e0 * ax + e1 * bx), sum(x^2) is the same for all splits
+                    float e0[3], e1[3];
+                    float fit = 0;
+                    for (int i = 0; i < 3; i++)
+                    {
+                        float s1 = sums[i1][i] - sums[i0][i];
+                        float s2 = sums[i2][i] - sums[i1][i];
+                        float ax = sums[i0][i] + s1 * 2 / 3.f + s2 * 1 / 3.f;
+                        float bx = sums[16][i] - sums[i2][i] + s2 * 2 / 3.f + s1 * 1 / 3.f;
+                        e0[i] = (ax * bb - bx * ab) / det;
+                        e1[i] = (bx * aa - ax * ab) / det;
+                        fit += e0[i] * ax + e1[i] * bx;
+                    }
+                    if (-fit < best_residual)
+                    {
+                        best_residual = -fit;
+                        std::copy(e0, e0 + 3, best_e0);
+                        std::copy(e1, e1 + 3, best_e1);
+                    }
+                }
+            }
+        }
+        if (best_residual == INFINITY)
+            return;
+
+        int e0[3], e1[3];
+        for (int i = 0; i < 3; i++)
+        {
+            e0[i] = std::clamp((int)lroundf(best_e0[i]), 0, 255);
+            e1[i] = std::clamp((int)lroundf(best_e1[i]), 0, 255);
+        }
+        dxt5_block t;
+        setColorEndpoints(t, to_rgb565(e0[2], e0[1], e0[0]), to_rgb565(e1[2], e1[1], e1[0]));
+        if (selectColorIndices(t, px) < best_error)
+            b.color_part = t.color_part;
+    }
+
+    // c[0] > c[1] selects the 4 color mode
+    static void setColorEndpoints(dxt5_block &b, color_rgb565 c0, color_rgb565 c1)
+    {
+        if (c0 < c1)
+            std::swap(c0, c1);
+        b.color_part = 0;
+        b.c[0] = c0;
+        b.c[1] = c1;
+    }
+
+    // nearest table entries, returns the squared error
+    static int selectAlphaIndices(dxt5_block &b, const color *px)
+    {
+        uint8_t at[8];
+        b.get_alpha_table(at);
+        b.alpha_part &= 0xFFFF;
+        int error = 0;
+#ifdef AIM_SSE2
+        alignas(16) uint8_t alphas[16];
+        for (int p = 0; p < 16; p++)
+            alphas[p] = px[p].a;
+        auto a = _mm_load_si128((const __m128i *)alphas);
+        auto best_d = _mm_set1_epi8(-1);
+        auto best_i = _mm_setzero_si128();
+        for (int i = 0; i < 8; i++)
+        {
+            auto t = _mm_set1_epi8((char)at[i]);
+            auto d = _mm_or_si128(_mm_subs_epu8(a, t), _mm_subs_epu8(t, a));
+            // d < best_d, the first entry wins ties as in the scalar code
+            auto ge = _mm_cmpeq_epi8(_mm_max_epu8(d, best_d), d);
+            best_d = _mm_min_epu8(d, best_d);
+            best_i = _mm_or_si128(_mm_and_si128(ge, best_i), _mm_andnot_si128(ge, _mm_set1_epi8(i)));
+        }
+        alignas(16) uint8_t idx[16], dist[16];
+        _mm_store_si128((__m128i *)idx, best_i);
+        _mm_store_si128((__m128i *)dist, best_d);
+        for (int p = 0; p < 16; p++)
+        {
+            b.alpha_part |= (uint64_t)idx[p] << (16 + p * 3);
+            error += dist[p] * dist[p];
+        }
+#else
+        for (int p = 0; p < 16; p++)
+        {
+            int best = 0;
+            for (int i = 1; i < 8; i++)
+            {
+                if (abs(at[i] - px[p].a) < abs(at[best] - px[p].a))
+                    best = i;
+            }
+            b.alpha_part |= (uint64_t)best << (16 + p * 3);
+            error += (at[best] - px[p].a) * (at[best] - px[p].a);
+        }
+#endif
+        return error;
+    }
+
+    // nearest table entries by squared rgb distance, returns the squared error
+    static int selectColorIndices(dxt5_block &b, const color *px)
+    {
+        color ct[4];
+        b.get_color_table(ct);
+        b.color_part &= 0xFFFFFFFF;
+        int error = 0;
+#ifdef AIM_SSE2
+        const auto rgb = _mm_set1_epi32(0x00FFFFFF);
+        for (int p = 0; p < 16; p += 4)
+        {
+            auto v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(px + p)), rgb);
+            auto best_d = distances(v, _mm_set1_epi32(ct[0].data));
+            auto best_i = _mm_setzero_si128();
+            for (int i = 1; i < 4; i++)
+            {
+                auto d = distances(v, _mm_set1_epi32(ct[i].data));
+                auto lt = _mm_cmplt_epi32(d, best_d);
+                best_d = _mm_or_si128(_mm_and_si128(lt, d), _mm_andnot_si128(lt, best_d));
+                best_i = _mm_or_si128(_mm_and_si128(lt, _mm_set1_epi32(i)), _mm_andnot_si128(lt, best_i));
+            }
+            alignas(16) int32_t idx[4], dist[4];
+            _mm_store_si128((__m128i *)idx, best_i);
+            _mm_store_si128((__m128i *)dist, best_d);
+            for (int k = 0; k < 4; k++)
+            {
+                b.color_part |= (uint64_t)idx[k] << (32 + (p + k) * 2);
+                error += dist[k];
+            }
+        }
+#else
+        for (int p = 0; p < 16; p++)
+        {
+            int best = 0;
+            int best_d = INT_MAX;
+            for (int i = 0; i < 4; i++)
+            {
+                int d = 0;
+                for (int j = 0; j < 3; j++)
+                    d += (ct[i].byte[j] - px[p].byte[j]) * (ct[i].byte[j] - px[p].byte[j]);
+                if (d < best_d)
+                {
+                    best = i;
+                    best_d = d;
+                }
+            }
+            b.color_part |= (uint64_t)best << (32 + p * 2);
+            error += best_d;
+        }
+#endif
+        return error;
+    }
+
+#ifdef AIM_SSE2
+    // squared distances of 4 pixels to c, alpha bytes must be 0
+    static __m128i distances(__m128i px, __m128i c)
+    {
+        auto z = _mm_setzero_si128();
+        auto lo = _mm_sub_epi16(_mm_unpacklo_epi8(px, z), _mm_unpacklo_epi8(c, z));
+        auto hi = _mm_sub_epi16(_mm_unpackhi_epi8(px, z), _mm_unpackhi_epi8(c, z));
+        // b*b + g*g and r*r + a*a per pixel, then the pairs are added
+        auto slo = _mm_castsi128_ps(_mm_madd_epi16(lo, lo));
+        auto shi = _mm_castsi128_ps(_mm_madd_epi16(hi, hi));
+        auto even = _mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(2, 0, 2, 0)));
+        auto odd = _mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(3, 1, 3, 1)));
+        return _mm_add_epi32(even, odd);
+    }
+#endif
+};
@@ -56,6 +56,7 @@ buffer::buffer(size_t size)
     : buf_(new std::vector<uint8_t>(size))
 {
     size_ = buf_->size();
+    end_ = size_;
     skip(0);
 }
 
@@ -146,6 +147,8 @@ void buffer::skip(int n) const
 {
     if (!buf_)
         throw std::logic_error("buffer: not initialized");
+    if (n > 0 && index_ + n > end_)
+        throw std::logic_error("buffer: too much data");
     index_ += n;
     data_offset += n;
     ptr = (uint8_t *)buf_->data() + index_;
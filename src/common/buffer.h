@@ -137,5 +137,5 @@ private:
     mutable uint8_t *ptr = 0;
     mutable uint32_t data_offset = 0;
     mutable uint32_t size_ = 0;
-    uint32_t end_;
+    uint32_t end_ = 0;
 };
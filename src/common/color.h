@@ -22,6 +22,73 @@
 
 typedef uint16_t color_rgb565;
 
+// integer colour math shared by the texture code
+// every function gives the same bits as the float/division code it replaced
+namespace color_math
+{
+
+// rgb565 channel expansion
+inline constexpr uint8_t expand5[] = {
+    0, 8, 16, 25, 33, 41, 49, 58, 66, 74, 82, 90, 99, 107, 115, 123, 132,
+    140, 148, 156, 165, 173, 181, 189, 197, 206, 214, 222, 230, 239, 247, 255 };
+inline constexpr uint8_t expand6[] = {
+    0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 45, 49, 53, 57, 61, 65, 69,
+    73, 77, 81, 85, 89, 93, 97, 101, 105, 109, 113, 117, 121, 125, 130, 134, 138,
+    142, 146, 150, 154, 158, 162, 166, 170, 174, 178, 182, 186, 190, 194, 198,
+    202, 206, 210, 215, 219, 223, 227, 231, 235, 239, 243, 247, 251, 255 };
+
+// uint8_t(a * m + b * (1 - m)) for m = 2/3 and 1/3, built once with that float expression
+// products are rounded separately (no fma contraction), as with msvc /fp:precise
+struct thirds_tables
+{
+    uint8_t two_thirds[256][256];
+    uint8_t one_third[256][256];
+
+    thirds_tables()
+    {
+        const float m2 = 2.f / 3.f;
+        const float m1 = 1.f / 3.f;
+        for (int a = 0; a < 256; a++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                two_thirds[a][b] = lerp(a, b, m2);
+                one_third[a][b] = lerp(a, b, m1);
+            }
+        }
+    }
+
+private:
+    // volatile forces both products to be stored as floats before the sum:
+    // without it gcc/clang may fuse a * m + ... into an fma (-mfma, -ffp-contract=fast)
+    // or keep x87 excess precision, both change the truncated result for some pairs.
+    // color_math_check compares the tables with an independently rounded reference.
+    static uint8_t lerp(int a, int b, float m)
+    {
+        volatile float x = a * m;
+        volatile float y = b * (1 - m);
+        return uint8_t(x + y);
+    }
+};
+
+inline const thirds_tables &get_thirds_tables()
+{
+    static const thirds_tables t;
+    return t;
+}
+
+inline uint8_t lerp_2_3(uint8_t a, uint8_t b) { return get_thirds_tables().two_thirds[a][b]; }
+inline uint8_t lerp_1_3(uint8_t a, uint8_t b) { return get_thirds_tables().one_third[a][b]; }
+// a * 0.5f + b * 0.5f is exact in float, so truncation is a shift
+inline uint8_t lerp_1_2(uint8_t a, uint8_t b) { return (a + b) >> 1; }
+
+// ((7 - i) * a + i * b) / 7 and ((5 - i) * a + i * b) / 5 with multiply and shift,
+// the reciprocals are exact for all sums of 8-bit values
+inline uint8_t alpha_ramp7(int i, uint8_t a, uint8_t b) { return ((7 - i) * a + i * b) * 9363 >> 16; }
+inline uint8_t alpha_ramp5(int i, uint8_t a, uint8_t b) { return ((5 - i) * a + i * b) * 13108 >> 16; }
+
+}
+
 struct color
 {
     union
@@ -43,18 +110,9 @@ struct color
     {}
     color(const color_rgb565 &c)
     {
-        static uint8_t Table5[] = {
-            0, 8, 16, 25, 33, 41, 49, 58, 66, 74, 82, 90, 99, 107, 115, 123, 132,
-            140, 148, 156, 165, 173, 181, 189, 197, 206, 214, 222, 230, 239, 247, 255 };
-        static uint8_t Table6[] = {
-            0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 45, 49, 53, 57, 61, 65, 69,
-            73, 77, 81, 85, 89, 93, 97, 101, 105, 109, 113, 117, 121, 125, 130, 134, 138,
-            142, 146, 150, 154, 158, 162, 166, 170, 174, 178, 182, 186, 190, 194, 198,
-            202, 206, 210, 215, 219, 223, 227, 231, 235, 239, 243, 247, 251, 255 };
-
-        b = Table5[c & 0x1F];
-        g = Table6[(c >> 5) & 0x3F];
-        r = Table5[(c >> 11) & 0x1F];
+        b = color_math::expand5[c & 0x1F];
+        g = color_math::expand6[(c >> 5) & 0x3F];
+        r = color_math::expand5[(c >> 11) & 0x1F];
     }
 
     operator uint32_t() const
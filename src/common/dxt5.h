@@ -16,6 +16,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
+#include <algorithm>
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -23,7 +27,10 @@
 #include "buffer.h"
 #include "color.h"
 #include "mat.h"
+#include "parallel.h"
+#include "simd.h"
 
+// packed block, as stored in files
 struct dxt5_block
 {
     union
@@ -37,76 +44,165 @@ struct dxt5_block
         uint16_t c[4];
     };
 
-    //
-    uint8_t alpha_table[8];
-    color color_table[4];
-    union
-    {
-        color pixels[16];
-        color pixel_mat[4][4];
-    };
-
     dxt5_block() {}
     void load(const buffer &b)
     {
         READ(b, alpha_part);
         READ(b, color_part);
     }
-    void unpack()
+
+    void get_alpha_table(uint8_t *t) const
     {
-        // alpha
-        auto &a = alpha_table;
-        a[0] = this->a[0];
-        a[1] = this->a[1];
+        t[0] = a[0];
+        t[1] = a[1];
         if (a[0] > a[1])
         {
-            a[2] = (uint8_t)(double(6 * a[0] + 1 * a[1]) / 7.0);
-            a[3] = (uint8_t)(double(5 * a[0] + 2 * a[1]) / 7.0);
-            a[4] = (uint8_t)(double(4 * a[0] + 3 * a[1]) / 7.0);
-            a[5] = (uint8_t)(double(3 * a[0] + 4 * a[1]) / 7.0);
-            a[6] = (uint8_t)(double(2 * a[0] + 5 * a[1]) / 7.0);
-            a[7] = (uint8_t)(double(1 * a[0] + 6 * a[1]) / 7.0);
+            for (int i = 1; i < 7; i++)
+                t[i + 1] = color_math::alpha_ramp7(i, a[0], a[1]);
         }
         else
         {
-            a[2] = (uint8_t)(double(4 * a[0] + 1 * a[1]) / 5.0);
-            a[3] = (uint8_t)(double(3 * a[0] + 2 * a[1]) / 5.0);
-            a[4] = (uint8_t)(double(2 * a[0] + 3 * a[1]) / 5.0);
-            a[5] = (uint8_t)(double(1 * a[0] + 4 * a[1]) / 5.0);
-            a[6] = 0;
-            a[7] = 255;
+            for (int i = 1; i < 5; i++)
+                t[i + 1] = color_math::alpha_ramp5(i, a[0], a[1]);
+            t[6] = 0;
+            t[7] = 255;
         }
-
-        // color
-        auto &c = color_table;
-        c[0] = color(this->c[0]);
-        c[1] = color(this->c[1]);
-        if (this->c[0] > this->c[1])
+    }
+    // alpha is 0 in the table, it comes from the alpha part
+    void get_color_table(color *t) const
+    {
+        t[0] = color(c[0]);
+        t[1] = color(c[1]);
+        if (c[0] > c[1])
         {
-            c[2] = interpolate(c[0], c[1], 2.f / 3.f);
-            c[3] = interpolate(c[0], c[1], 1.f / 3.f);
+            auto &lut = color_math::get_thirds_tables();
+            for (int i = 0; i < 3; i++)
+            {
+                t[2].byte[i] = lut.two_thirds[t[0].byte[i]][t[1].byte[i]];
+                t[3].byte[i] = lut.one_third[t[0].byte[i]][t[1].byte[i]];
+            }
         }
         else
         {
-            c[2] = interpolate(c[0], c[1], 1.f / 2.f);
-            c[3].data = 0;
+            for (int i = 0; i < 3; i++)
+                t[2].byte[i] = color_math::lerp_1_2(t[0].byte[i], t[1].byte[i]);
+            t[3].data = 0;
         }
+        for (int i = 0; i < 4; i++)
+            t[i].a = 0;
+    }
 
-        // result
-        for (int p = 0; p < 16; p++)
+    // writes 4x4 pixels to dst, rows are stride pixels apart (negative for bottom-up images)
+    void decode(color *dst, ptrdiff_t stride) const
+    {
+        uint8_t at[8];
+        color ct[4];
+        get_alpha_table(at);
+        get_color_table(ct);
+
+        auto color_bits = uint32_t(color_part >> 32);
+        auto alpha_bits = alpha_part >> 16;
+#ifdef AIM_X86
+        if (cpu_has_avx2)
+            return decode_avx2(dst, stride, ct, at, color_bits, alpha_bits);
+        if (cpu_has_ssse3)
+            return decode_ssse3(dst, stride, ct, at, color_bits, alpha_bits);
+#endif
+        for (int row = 0; row < 4; row++, color_bits >>= 8, alpha_bits >>= 12)
         {
-            pixels[p] = c[(color_part >> (32 + p * 2)) & 0b11];
-            pixels[p].a = a[(alpha_part >> (16 + p * 3)) & 0b111];
+            auto d = dst + row * stride;
+            for (int col = 0; col < 4; col++)
+            {
+                d[col] = ct[(color_bits >> (col * 2)) & 0b11];
+                d[col].a = at[(alpha_bits >> (col * 3)) & 0b111];
+            }
         }
     }
-    color interpolate(color c0, color c1, float m)
+
+private:
+#ifdef AIM_X86
+    // pshufb controls picking 4 colors of a row from the table by their 2 bit indices
+    struct color_shuffles
     {
-        color r;
-        for (int i = 0; i < 4; i++)
-            r.byte[i] = uint8_t(c0.byte[i] * m + c1.byte[i] * (1 - m));
-        return r;
+        alignas(16) uint8_t v[256][16];
+    };
+    static const color_shuffles &get_color_shuffles()
+    {
+        static const auto shuffles = []
+        {
+            color_shuffles s;
+            for (int bits = 0; bits < 256; bits++)
+            {
+                for (int col = 0; col < 4; col++)
+                {
+                    int i = (bits >> (col * 2)) & 0b11;
+                    for (int b = 0; b < 4; b++)
+                        s.v[bits][col * 4 + b] = i * 4 + b;
+                }
+            }
+            return s;
+        }();
+        return shuffles;
     }
+    // 3 bit alpha indices of a row, one per byte
+    static uint32_t alpha_row(uint64_t alpha_bits)
+    {
+        return
+            ((alpha_bits >> 0) & 7) |
+            ((alpha_bits >> 3) & 7) << 8 |
+            ((alpha_bits >> 6) & 7) << 16 |
+            ((alpha_bits >> 9) & 7) << 24;
+    }
+
+    // one row per step
+    AIM_TARGET_SSSE3
+    static void decode_ssse3(color *dst, ptrdiff_t stride, const color *ct, const uint8_t *at, uint32_t color_bits, uint64_t alpha_bits)
+    {
+        auto &shuffles = get_color_shuffles();
+        // alpha indices of a row go to the alpha bytes, others select nothing (0x80)
+        const auto spread = _mm_setr_epi8(-1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3);
+        const auto no_alpha = _mm_setr_epi8(-128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0);
+        auto colors = _mm_loadu_si128((const __m128i *)ct);
+        auto alphas = _mm_loadl_epi64((const __m128i *)at);
+        for (int row = 0; row < 4; row++, color_bits >>= 8, alpha_bits >>= 12)
+        {
+            auto c = _mm_shuffle_epi8(colors, _mm_load_si128((const __m128i *)shuffles.v[color_bits & 0xFF]));
+            auto aidx = _mm_or_si128(_mm_shuffle_epi8(_mm_cvtsi32_si128(alpha_row(alpha_bits)), spread), no_alpha);
+            auto a = _mm_shuffle_epi8(alphas, aidx);
+            _mm_storeu_si128((__m128i *)(dst + row * stride), _mm_or_si128(c, a));
+        }
+    }
+
+    // same as ssse3, two rows per step, one in each 128 bit lane
+    AIM_TARGET_AVX2
+    static void decode_avx2(color *dst, ptrdiff_t stride, const color *ct, const uint8_t *at, uint32_t color_bits, uint64_t alpha_bits)
+    {
+        auto &shuffles = get_color_shuffles();
+        const auto spread = _mm256_setr_epi8(
+            -1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3,
+            -1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3);
+        const auto no_alpha = _mm256_setr_epi8(
+            -128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0,
+            -128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0, -128, -128, -128, 0);
+        auto colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ct));
+        auto alphas = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *)at));
+        for (int row = 0; row < 4; row += 2, color_bits >>= 16, alpha_bits >>= 24)
+        {
+            auto cidx = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_load_si128((const __m128i *)shuffles.v[color_bits & 0xFF])),
+                _mm_load_si128((const __m128i *)shuffles.v[(color_bits >> 8) & 0xFF]), 1);
+            auto ai = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_cvtsi32_si128(alpha_row(alpha_bits))),
+                _mm_cvtsi32_si128(alpha_row(alpha_bits >> 12)), 1);
+            auto aidx = _mm256_or_si256(_mm256_shuffle_epi8(ai, spread), no_alpha);
+            auto p = _mm256_or_si256(_mm256_shuffle_epi8(colors, cidx), _mm256_shuffle_epi8(alphas, aidx));
+            _mm_storeu_si128((__m128i *)(dst + row * stride), _mm256_castsi256_si128(p));
+            _mm_storeu_si128((__m128i *)(dst + (row + 1) * stride), _mm256_extracti128_si256(p, 1));
+        }
+    }
+#endif
 };
+static_assert(sizeof(dxt5_block) == 16);
 
 struct dxt5
 {
@@ -123,42 +219,54 @@ struct dxt5
     void load_blocks(const buffer &b)
     {
         blocks.resize(width * height / 16);
-        for (auto &d : blocks)
-        {
-            d.load(b);
-            d.unpack();
-        }
+        b._read(blocks.data(), blocks.size() * sizeof(dxt5_block));
     }
-    mat<uint32_t> unpack_mmm()
+    // blocks are grouped in 64x64 macro tiles of 16x16 blocks, tiles are decoded in parallel
+    mat<uint32_t> unpack_mmm() const
+    {
+        return unpack_mmm(blocks.data(), blocks.size(), width, height);
+    }
+    // blocks are not copied, they can point straight into file data
+    static mat<uint32_t> unpack_mmm(const dxt5_block *blocks, size_t n, int width, int height)
     {
         mat<uint32_t> m(width, height);
-        auto big_xsegs = width / 64;
-        auto big_ysegs = height / 64;
-        for (size_t seg = 0; seg < blocks.size(); seg++)
+        auto v = m.view().flipped(); // blocks are top-down, bmp rows are bottom-up
+        auto stride = v.getStride() / (ptrdiff_t)sizeof(uint32_t);
+        auto tiles_x = width / 64;
+        if (!tiles_x)
+            return m;
+        auto n_tiles = std::min<size_t>(n / 256, (size_t)tiles_x * (height / 64));
+        parallel_for(n_tiles, [blocks, &v, stride, tiles_x](size_t tile)
         {
-            auto &d = blocks[seg];
-            int big_seg = seg / 256;
-            auto big_xseg = big_seg % big_xsegs;
-            auto big_yseg = big_seg / big_xsegs;
-            auto xseg = seg % 16 + big_xseg * 16;
-            auto yseg = seg % 256 / 16 + big_yseg * 16;
-            for (int i = 0; i < 4; i++)
-                memcpy(&m(height - 1 - (yseg * 4 + i), xseg * 4), d.pixel_mat[i], 16);
-        }
+            // a tile is 16 consecutive rows of 16 blocks, each row of blocks is 4 rows of pixels
+            auto b = blocks + tile * 256;
+            auto dst = (color *)&v(tile / tiles_x * 64, tile % tiles_x * 64);
+            for (int row = 0; row < 16; row++, b += 16, dst += stride * 4)
+            {
+                for (int col = 0; col < 16; col++)
+                    b[col].decode(dst + col * 4, stride);
+            }
+        });
         return m;
     }
-    mat<uint32_t> unpack_tm()
+    // rows of blocks are decoded in parallel
+    mat<uint32_t> unpack_tm() const
     {
         mat<uint32_t> m(width, height);
+        auto v = m.view().flipped();
+        auto stride = v.getStride() / (ptrdiff_t)sizeof(uint32_t);
         auto xsegs = width / 4;
-        for (size_t seg = 0; seg < blocks.size(); seg++)
+        auto ysegs = height / 4;
+        const size_t rows_per_task = 8;
+        parallel_for((ysegs + rows_per_task - 1) / rows_per_task, [this, &v, stride, xsegs, ysegs, rows_per_task](size_t i)
         {
-            auto &d = blocks[seg];
-            auto xseg = seg % xsegs;
-            auto yseg = seg / xsegs;
-            for (int i = 0; i < 4; i++)
-                memcpy(&m(height - 1 - (yseg * 4 + i), xseg * 4), d.pixel_mat[i], 16);
-        }
+            auto end = std::min<size_t>(ysegs, (i + 1) * rows_per_task);
+            for (size_t yseg = i * rows_per_task; yseg < end; yseg++)
+            {
+                for (size_t xseg = 0; xseg < xsegs; xseg++)
+                    blocks[yseg * xsegs + xseg].decode((color *)&v(yseg * 4, xseg * 4), stride);
+            }
+        });
         return m;
     }
 };
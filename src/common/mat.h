@@ -23,15 +23,141 @@
 
 #include <primitives/filesystem.h>
 
+#include <simd.h>
+
+#include <algorithm>
 #include <assert.h>
 #include <deque>
+#include <new>
+#include <stddef.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
 #include <vector>
 
+// 64 byte aligned storage, so rows of power of two widths start on cache lines and simd loads can be aligned
+template <class T, size_t Alignment = 64>
+struct aligned_allocator
+{
+    using value_type = T;
+    template <class U>
+    struct rebind { using other = aligned_allocator<U, Alignment>; };
+
+    aligned_allocator() = default;
+    template <class U>
+    aligned_allocator(const aligned_allocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) { return (T *)::operator new(n * sizeof(T), std::align_val_t(Alignment)); }
+    void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    template <class U>
+    bool operator==(const aligned_allocator<U, Alignment> &) const { return true; }
+    template <class U>
+    bool operator!=(const aligned_allocator<U, Alignment> &) const { return false; }
+};
+
+// non-owning window into a mat, nothing is copied
+// rows are stride elements apart, stride is negative for flipped views
+template <class T>
+class mat_view
+{
+public:
+    using type = T;
+
+public:
+    mat_view() = default;
+    mat_view(T *data, int width, int height, ptrdiff_t stride)
+        : ptr(data), width(width), height(height), stride(stride)
+    {}
+
+    T &operator()(int row, int col) const
+    {
+        assert(!(row >= height || col >= width || row < 0 || col < 0));
+        return ptr[row * stride + col];
+    }
+    T *getRow(int row) const { return ptr + row * stride; }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int size() const { return width * height; }
+    ptrdiff_t getStride() const { return stride * (ptrdiff_t)sizeof(T); } // bytes, as mat::getStride()
+
+    mat_view crop(int col, int row, int w, int h) const
+    {
+        assert(col >= 0 && row >= 0 && w >= 0 && h >= 0 && col + w <= width && row + h <= height);
+        return { getRow(row) + col, w, h, stride };
+    }
+    mat_view rows(int first, int n) const { return crop(0, first, width, n); }
+    // tiles on the right and bottom edges may be smaller
+    mat_view tile(int tx, int ty, int tw, int th) const
+    {
+        int col = tx * tw;
+        int row = ty * th;
+        return crop(col, row, std::min(tw, width - col), std::min(th, height - row));
+    }
+    // same pixels, rows in reverse order
+    mat_view flipped() const { return { height ? getRow(height - 1) : ptr, width, height, -stride }; }
+
+    operator mat_view<const T>() const { return { ptr, width, height, stride }; }
+
+private:
+    T *ptr = nullptr;
+    int width = 0;
+    int height = 0;
+    ptrdiff_t stride = 0;
+};
+
+namespace detail
+{
+
+inline void swap_rows(void *a, void *b, size_t n)
+{
+    auto pa = (uint8_t *)a;
+    auto pb = (uint8_t *)b;
+    size_t i = 0;
+#ifdef AIM_SSE2
+    for (; i + 16 <= n; i += 16)
+    {
+        auto va = _mm_loadu_si128((__m128i *)(pa + i));
+        auto vb = _mm_loadu_si128((__m128i *)(pb + i));
+        _mm_storeu_si128((__m128i *)(pa + i), vb);
+        _mm_storeu_si128((__m128i *)(pb + i), va);
+    }
+#endif
+    for (; i < n; i++)
+        std::swap(pa[i], pb[i]);
+}
+
+template <class T>
+void mirror_row(T *p, int n)
+{
+    int i = 0;
+    int j = n;
+#ifdef AIM_SSE2
+    if constexpr (sizeof(T) == 4 && std::is_trivially_copyable_v<T>)
+    {
+        // swap 4 elements from both ends, reversed
+        for (; j - i >= 8; i += 4, j -= 4)
+        {
+            auto a = _mm_loadu_si128((__m128i *)(p + i));
+            auto b = _mm_loadu_si128((__m128i *)(p + j - 4));
+            _mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+            _mm_storeu_si128((__m128i *)(p + j - 4), _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
+    }
+#endif
+    std::reverse(p + i, p + j);
+}
+
+}
+
 template <class T>
 class mat
 {
 public:
     using type = T;
+    using storage = std::vector<T, aligned_allocator<T>>;
 
 public:
     mat(int w = 0, int h = 0)
@@ -40,6 +166,13 @@ public:
         height = h < 0 ? 0 : h;
         data.resize(width * height, T());
     }
+    // copy of a view
+    explicit mat(const mat_view<const T> &v)
+        : mat(v.getWidth(), v.getHeight())
+    {
+        for (int row = 0; row < height; row++)
+            std::copy(v.getRow(row), v.getRow(row) + width, getRow(row));
+    }
 
     T &operator()(int i)
     {
@@ -69,62 +202,63 @@ public:
     int getHeight() const { return height; }
     int size() const { return width * height; }
     int getBytesLength() const { return size() * sizeof(T); }
+    // bytes from one row to the next, can be used to wrap the data without copying
+    size_t getStride() const { return width * sizeof(T); }
+    T *getRow(int row) { return data.data() + (size_t)row * width; }
+    const T *getRow(int row) const { return data.data() + (size_t)row * width; }
     int getPos(const T *const elem) const { return elem - &data[0]; }
-    const std::vector<T> &getData() const { return data; }
-    std::vector<T> &getData() { return data; }
+    const storage &getData() const { return data; }
+    storage &getData() { return data; }
+
+    mat_view<T> view() { return { data.data(), width, height, width }; }
+    mat_view<const T> view() const { return { data.data(), width, height, width }; }
+    mat_view<T> crop(int col, int row, int w, int h) { return view().crop(col, row, w, h); }
+    mat_view<const T> crop(int col, int row, int w, int h) const { return view().crop(col, row, w, h); }
+    mat_view<T> rows(int first, int n) { return view().rows(first, n); }
+    mat_view<const T> rows(int first, int n) const { return view().rows(first, n); }
+    mat_view<T> tile(int tx, int ty, int tw, int th) { return view().tile(tx, ty, tw, th); }
+    mat_view<const T> tile(int tx, int ty, int tw, int th) const { return view().tile(tx, ty, tw, th); }
 
     auto begin() { return data.begin(); }
     auto end() { return data.end(); }
     auto begin() const { return data.begin(); }
     auto end() const { return data.end(); }
 
-    // left/right
-    mat mirror() const
+    // left/right
+    mat mirror() const
     {
-        int cols = width;
-        int rows = height;
-        mat<uint32_t> m(width, height);
-        for (int row = 0; row < rows; row++)
-        {
-            for (int col = 0; col < cols; col++)
-            {
-                auto &o = operator()(row * cols + col);
-                auto &n = m(row * cols + (cols - 1 - col));
-                n = o;
-            }
-        }
+        auto m = *this;
+        m.mirrorInPlace();
         return m;
-    }
-
-    // up/down
-    mat flip() const
+    }
+    void mirrorInPlace()
     {
-        int cols = width;
-        int rows = height;
-        mat<uint32_t> m(width, height);
-        for (int row = 0; row < rows; row++)
-        {
-            for (int col = 0; col < cols; col++)
-            {
-                auto &o = operator()(row * cols + col);
-                auto &n = m((rows - 1 - row) * cols + col);
-                n = o;
-            }
-        }
+        for (int row = 0; row < height; row++)
+            detail::mirror_row(getRow(row), width);
+    }
+
+    // up/down
+    mat flip() const
+    {
+        auto m = *this;
+        m.flipInPlace();
         return m;
     }
+    void flipInPlace()
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        for (int row = 0; row < height / 2; row++)
+            detail::swap_rows(getRow(row), getRow(height - 1 - row), getStride());
+    }
 
 private:
-    std::vector<T> data;
+    storage data;
     int width;
     int height;
 };
 
-inline void write_mat_bmp(const path &filename, int width, int height, int bits, const uint8_t *b, size_t s)
+inline void write_bmp_header(FILE *f, int width, int height, int bits, size_t s)
 {
-    auto f = primitives::filesystem::fopen(filename, "wb");
-    if (f == nullptr)
-        return;
     bmp_header h = { 0 };
     h.bfType = 0x4D42;
     h.bfSize = sizeof(bmp_header) + sizeof(bmp_info_header) + s;
@@ -143,6 +277,14 @@ inline void write_mat_bmp(const path &filename, int width, int height, int bits,
     i.biClrImportant = 0;
     fwrite(&h, sizeof(bmp_header), 1, f);
     fwrite(&i, sizeof(bmp_info_header), 1, f);
+}
+
+inline void write_mat_bmp(const path &filename, int width, int height, int bits, const uint8_t *b, size_t s)
+{
+    auto f = primitives::filesystem::fopen(filename, "wb");
+    if (f == nullptr)
+        return;
+    write_bmp_header(f, width, height, bits, s);
     fwrite(b, s, 1, f);
     fclose(f);
 }
@@ -153,6 +295,50 @@ void write_mat_bmp(const path &filename, const mat<T> &m)
     write_mat_bmp(filename, m.getWidth(), m.getHeight(), sizeof(T) * CHAR_BIT, (const uint8_t *)&m(0, 0), m.size() * sizeof(T));
 }
 
+// 24 and 32 bit uncompressed bitmaps, rows are bottom-up as written by write_mat_bmp
+// 24 bit images get opaque alpha
+inline mat<uint32_t> read_mat_bmp(const path &filename)
+{
+    auto f = primitives::filesystem::fopen(filename, "rb");
+    if (f == nullptr)
+        throw std::runtime_error("Cannot open file: " + to_printable_string(filename));
+
+    bmp_header h;
+    bmp_info_header i;
+    if (fread(&h, sizeof(h), 1, f) != 1 || fread(&i, sizeof(i), 1, f) != 1 ||
+        h.bfType != 0x4D42 || (i.biBitCount != 24 && i.biBitCount != 32) || i.biCompression != 0 || i.biWidth < 0)
+    {
+        fclose(f);
+        throw std::runtime_error("Unsupported bmp: " + to_printable_string(filename));
+    }
+
+    mat<uint32_t> m(i.biWidth, abs(i.biHeight));
+    int bpp = i.biBitCount / 8;
+    std::vector<uint8_t> row((m.getWidth() * bpp + 3) & ~3);
+    fseek(f, h.bfOffBits, SEEK_SET);
+    for (int y = 0; y < m.getHeight(); y++)
+    {
+        if (fread(row.data(), row.size(), 1, f) != 1)
+        {
+            fclose(f);
+            throw std::runtime_error("Unexpected end of bmp: " + to_printable_string(filename));
+        }
+        if (bpp == 4)
+        {
+            memcpy(m.getRow(y), row.data(), m.getWidth() * 4);
+            continue;
+        }
+        auto dst = m.getRow(y);
+        for (int x = 0; x < m.getWidth(); x++)
+            dst[x] = row[x * 3] | row[x * 3 + 1] << 8 | row[x * 3 + 2] << 16 | 0xFF000000;
+    }
+    fclose(f);
+    // negative height is a top-down bitmap
+    if (i.biHeight < 0)
+        m.flipInPlace();
+    return m;
+}
+
 template<class T>
 void write_mat_tga(const path &filename, const mat<T> &m)
 {
@@ -0,0 +1,131 @@
+/*
+ * AIM tools
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/executor.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Number of threads used by parallel_for, 0 means the executor default.
+// Changing it makes the next call start a new pool, calls running on the old one keep it alive.
+inline std::atomic<size_t> parallel_threads = 0;
+
+namespace detail
+{
+
+struct parallel_pool
+{
+    std::mutex m;
+    std::shared_ptr<Executor> e;
+    size_t threads = 0;
+};
+
+inline parallel_pool &get_parallel_pool()
+{
+    static parallel_pool p;
+    return p;
+}
+
+// set while a pool thread runs a parallel_for call, nested calls run inline there
+// instead of waiting for a pool that is busy with their parent
+inline thread_local bool in_parallel_pool = false;
+
+}
+
+// Process-wide pool shared by all parallel_for calls, threads are started once.
+// Callers hold the returned pointer while they use the pool, so replacing it is safe.
+inline std::shared_ptr<Executor> parallel_executor()
+{
+    auto &p = detail::get_parallel_pool();
+    std::unique_lock lk(p.m);
+    size_t threads = parallel_threads;
+    if (!p.e || p.threads != threads)
+    {
+        p.e = threads ? std::make_shared<Executor>(threads) : std::make_shared<Executor>();
+        p.threads = threads;
+    }
+    return p.e;
+}
+
+// Calls f(i) for every i in [0, n) on a thread pool and waits for all calls.
+// If some calls throw, the exception with the lowest i is rethrown,
+// so errors do not depend on scheduling.
+template <class F>
+void parallel_for(size_t n, F &&f)
+{
+    if (n == 0)
+        return;
+    if (n == 1)
+    {
+        f(0);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(n);
+    auto call = [&f, &errors](size_t i)
+    {
+        try
+        {
+            f(i);
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    if (detail::in_parallel_pool)
+    {
+        for (size_t i = 0; i < n; i++)
+            call(i);
+    }
+    else
+    {
+        // only this call's tasks are waited for, the pool may be shared with other threads
+        std::mutex m;
+        std::condition_variable cv;
+        size_t left = n;
+        auto e = parallel_executor();
+        for (size_t i = 0; i < n; i++)
+        {
+            e->push([&call, &m, &cv, &left, i]()
+            {
+                detail::in_parallel_pool = true;
+                call(i);
+                detail::in_parallel_pool = false;
+                std::unique_lock lk(m);
+                if (--left == 0)
+                    cv.notify_all();
+            });
+        }
+        std::unique_lock lk(m);
+        cv.wait(lk, [&left] { return left == 0; });
+    }
+
+    for (auto &ep : errors)
+    {
+        if (ep)
+            std::rethrow_exception(ep);
+    }
+}
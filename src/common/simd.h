@@ -0,0 +1,86 @@
+/*
+ * AIM tools
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// instruction set selection, every user must keep a scalar path
+//
+// sse2 is part of x64, it is used when the compiler targets it (AIM_SSE2)
+// msvc does not define __SSE2__, so its own macros are checked too
+//
+// ssse3 and avx2 are not enabled by the default msvc/gcc x64 flags, so kernels using them
+// are marked AIM_TARGET_SSSE3/AIM_TARGET_AVX2 and called only when cpu_has_ssse3/cpu_has_avx2 are set:
+// gcc/clang compile such functions for that instruction set, msvc accepts the intrinsics without flags
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AIM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AIM_X86 1
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define AIM_TARGET_SSSE3
+#define AIM_TARGET_AVX2
+#else
+#define AIM_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define AIM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace detail
+{
+
+inline bool detect_ssse3()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init(); // may run before libgcc initialized its cpu model
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+inline bool detect_avx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return false;
+    __cpuid(r, 1);
+    // the os must save ymm registers (osxsave, xcr0 bits 1 and 2)
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+}
+
+inline const bool cpu_has_ssse3 = detail::detect_ssse3();
+inline const bool cpu_has_avx2 = detail::detect_avx2();
+#endif
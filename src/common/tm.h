@@ -0,0 +1,145 @@
+/*
+ * AIM tools
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "dxt5.h"
+#include "mat.h"
+#include "parallel.h"
+#include "simd.h"
+
+// .TM texture
+struct tm_texture
+{
+    int width = 0;
+    int height = 0;
+    int dxt5_flag = 0;
+
+    dxt5 d; // when dxt5_flag is set
+    buffer simple; // 4 bits per channel otherwise
+    // file header as read, save() writes it back, zeros for new textures
+    std::array<uint8_t, 0x4C> header{};
+
+    void load(const buffer &src)
+    {
+        READ(src, header);
+        memcpy(&width, header.data(), sizeof(width));
+        memcpy(&height, header.data() + 4, sizeof(height));
+        dxt5_flag = header[0x10];
+
+        if (dxt5_flag)
+        {
+            d.width = width;
+            d.height = height;
+            d.load_blocks(src);
+        }
+        else
+            simple = buffer(src, width * height * 2);
+    }
+
+    // only dxt5 textures are written, header is written back with width, height and the flag patched
+    void save(const path &fn) const
+    {
+        if (!dxt5_flag)
+            throw std::logic_error("tm_texture: only dxt5 textures can be saved");
+        auto h = header;
+        memcpy(h.data(), &width, sizeof(width));
+        memcpy(h.data() + 4, &height, sizeof(height));
+        h[0x10] = 1;
+        auto f = primitives::filesystem::fopen(fn, "wb");
+        if (f == nullptr)
+            throw std::runtime_error("Cannot open file: " + to_printable_string(fn));
+        fwrite(h.data(), h.size(), 1, f);
+        fwrite(d.blocks.data(), d.blocks.size() * sizeof(dxt5_block), 1, f);
+        fclose(f);
+    }
+
+    mat<uint32_t> unpack() const
+    {
+        if (dxt5_flag)
+            return d.unpack_tm();
+
+        // rows are top-down in the file, bmp rows are bottom-up
+        mat<uint32_t> m(width, height);
+        auto v = m.view().flipped();
+        auto src = simple.getPtr();
+        const int rows_per_task = 32;
+        parallel_for((height + rows_per_task - 1) / rows_per_task, [this, &v, src, rows_per_task](size_t i)
+        {
+            auto end = std::min<int>(height, (i + 1) * rows_per_task);
+            for (int row = i * rows_per_task; row < end; row++)
+                expand_4bit((uint8_t *)v.getRow(row), src + (size_t)row * width * 2, width * 2);
+        });
+        return m;
+    }
+
+private:
+#ifdef AIM_X86
+    // returns the number of expanded source bytes, the caller finishes the tail
+    AIM_TARGET_AVX2
+    static size_t expand_4bit_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+    {
+        size_t i = 0;
+        const auto lo_mask = _mm256_set1_epi16(0x000F);
+        const auto hi_mask = _mm256_set1_epi16(0x0F00);
+        for (; i + 16 <= n; i += 16)
+        {
+            // 0x00hl -> 0x0h0l -> 0xhhll
+            auto x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+            auto w = _mm256_or_si256(_mm256_and_si256(x, lo_mask), _mm256_and_si256(_mm256_slli_epi16(x, 4), hi_mask));
+            _mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_or_si256(w, _mm256_slli_epi16(w, 4)));
+        }
+        return i;
+    }
+#endif
+
+    // every nibble becomes a byte (x -> x * 0x11), low nibble first, dst gets n * 2 bytes
+    static void expand_4bit(uint8_t *dst, const uint8_t *src, size_t n)
+    {
+        size_t i = 0;
+#ifdef AIM_X86
+        if (cpu_has_avx2)
+            i = expand_4bit_avx2(dst, src, n);
+#endif
+#ifdef AIM_SSE2
+        const auto mask = _mm_set1_epi8(0x0F);
+        for (; i + 16 <= n; i += 16)
+        {
+            auto x = _mm_loadu_si128((const __m128i *)(src + i));
+            auto lo = _mm_and_si128(x, mask);
+            auto hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+            auto a = _mm_unpacklo_epi8(lo, hi);
+            auto b = _mm_unpackhi_epi8(lo, hi);
+            _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_or_si128(a, _mm_slli_epi16(a, 4)));
+            _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_or_si128(b, _mm_slli_epi16(b, 4)));
+        }
+#endif
+        for (; i < n; i++)
+        {
+            dst[i * 2] = (src[i] & 0x0F) * 0x11;
+            dst[i * 2 + 1] = (src[i] >> 4) * 0x11;
+        }
+    }
+};
@@ -35,13 +35,27 @@ struct mmm
 {
     uint32_t unk1;
     uint32_t unk2;
-    dxt5 data;
+    uint32_t width;
+    uint32_t height;
+    const dxt5_block *blocks = nullptr; // points into the file data
+    size_t n_blocks = 0;
+    buffer file; // keeps block data alive
 
     void load(const buffer &b)
     {
+        file = b;
         READ(b, unk1);
         READ(b, unk2);
-        data.load(b);
+        READ(b, width);
+        READ(b, height);
+        n_blocks = width * height / 16;
+        blocks = (const dxt5_block *)b.getPtr();
+        b.skip(n_blocks * sizeof(dxt5_block));
+    }
+
+    mat<uint32_t> unpack() const
+    {
+        return dxt5::unpack_mmm(blocks, n_blocks, width, height);
     }
 };
 
@@ -63,7 +77,7 @@ mmm read_mmm(const path &fn)
 void process_mmm(const path &fn)
 {
     auto m = read_mmm(fn);
-    write_mat_bmp(path(fn) += ".bmp", m.data.unpack_mmm());
+    write_mat_bmp(path(fn) += ".bmp", m.unpack());
 }
 
 int main(int argc, char *argv[])
@@ -17,12 +17,22 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <stdio.h>
+#include <string.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -32,6 +42,7 @@
 
 #include <Polygon4/DataManager/Storage.h>
 #include <Polygon4/DataManager/Types.h>
+#include <primitives/executor.h>
 #include <primitives/filesystem.h>
 #include <primitives/sw/main.h>
 #include <primitives/sw/settings.h>
@@ -103,7 +114,76 @@ mmo_storage read_mmo(const path &fn)
     return s;
 }
 
-void write_mmo(Storage *storage, const mmo_storage &s)
+// hash indices over the database rows write_mmo looks up
+// built once per run and updated by write_mmo as it inserts rows
+struct db_index
+{
+    // position, yaw and scale of a placed building or object, -0 is stored as 0
+    // rows with equal placements are compared as a whole, so map and building/object are checked there
+    struct placement
+    {
+        float v[5];
+
+        template <class T>
+        explicit placement(const T &o)
+            : v{ (float)o.x, (float)o.y, (float)o.z, (float)o.yaw, (float)o.scale }
+        {
+            for (auto &f : v)
+            {
+                if (f == 0)
+                    f = 0;
+            }
+        }
+
+        bool operator==(const placement &rhs) const { return memcmp(v, rhs.v, sizeof(v)) == 0; }
+    };
+    struct placement_hash
+    {
+        size_t operator()(const placement &p) const
+        {
+            size_t h = 0;
+            for (auto f : p.v)
+            {
+                uint32_t u;
+                memcpy(&u, &f, sizeof(u));
+                h = h * 1000003 ^ u;
+            }
+            return h;
+        }
+    };
+    template <class T>
+    using placements = std::unordered_multimap<placement, const T *, placement_hash>;
+
+    // text_id -> id, the lowest id wins as with a scan in id order
+    std::unordered_map<std::string, int> maps;
+    std::unordered_map<std::string, int> buildings;
+    std::unordered_map<std::string, int> objects;
+    placements<MapBuilding> mapBuildings;
+    placements<polygon4::detail::MapObject> mapObjects;
+
+    db_index(const Storage &storage)
+    {
+        for (auto &[id, m] : storage.maps)
+            maps.emplace(m->text_id, id);
+        for (auto &[id, b] : storage.buildings)
+            buildings.emplace(b->text_id, id);
+        for (auto &[id, o] : storage.objects)
+            objects.emplace(o->text_id, id);
+        for (auto &[id, mb] : storage.mapBuildings)
+            mapBuildings.emplace(placement(*mb), &*mb);
+        for (auto &[id, mo] : storage.mapObjects)
+            mapObjects.emplace(placement(*mo), &*mo);
+    }
+
+    template <class T>
+    static bool contains(const placements<T> &index, const T &row)
+    {
+        auto [b, e] = index.equal_range(placement(row));
+        return std::any_of(b, e, [&row](const auto &p) { return *p.second == row; });
+    }
+};
+
+void write_mmo(Storage *storage, db_index &index, const mmo_storage &s)
 {
     std::string map_name = to_printable_string(s.name.filename().stem());
     if (!prefix.empty())
@@ -111,20 +191,15 @@ void write_mmo(Storage *storage, const mmo_storage &s)
     std::transform(map_name.begin(), map_name.end(), map_name.begin(), ::tolower);
 
     int map_id = 0;
-    for (auto &m : storage->maps)
-    {
-        if (m.second->text_id == map_name)
-        {
-            map_id = m.first;
-            break;
-        }
-    }
+    if (auto i = index.maps.find(map_name); i != index.maps.end())
+        map_id = i->second;
 
     if (map_id == 0)
     {
         auto m = storage->addMap();
         m->text_id = map_name;
         map_id = m->getId();
+        index.maps.emplace(map_name, map_id);
         //throw SW_RUNTIME_ERROR("error: map '" + map_name + "' is not found in the database");
     }
 
@@ -152,19 +227,17 @@ void write_mmo(Storage *storage, const mmo_storage &s)
                 objs.insert(object.name1);
             for (auto &o : objs)
             {
-                auto iter = std::find_if(storage->buildings.begin(), storage->buildings.end(), [&](const auto &p)
-                {
-                    return p.second->text_id == o;
-                });
-                if (iter == storage->buildings.end())
+                auto iter = index.buildings.find(o);
+                if (iter == index.buildings.end())
                 {
                     auto bld = storage->addBuilding();
                     bld->text_id = o;
                     bld_ids[o] = bld->getId();
+                    index.buildings.emplace(o, bld->getId());
                 }
                 else
                 {
-                    bld_ids[o] = iter->second->getId();
+                    bld_ids[o] = iter->second;
                 }
             }
             for (auto &object : segment->objects)
@@ -183,15 +256,12 @@ void write_mmo(Storage *storage, const mmo_storage &s)
                 mb.pitch = 0;
                 mb.yaw = calc_yaw(object.m_rotate_z);
                 mb.scale = ASSIGN(object.m_rotate_z[2].z, 1);
-                auto i = find_if(storage->mapBuildings.begin(), storage->mapBuildings.end(), [&](const auto &p)
-                {
-                    return *p.second == mb;
-                });
-                if (i == storage->mapBuildings.end())
+                if (!db_index::contains(index.mapBuildings, mb))
                 {
                     auto mb2 = storage->addMapBuilding(storage->maps[map_id]);
                     mb.setId(mb2->getId());
                     *mb2 = mb;
+                    index.mapBuildings.emplace(db_index::placement(*mb2), &*mb2);
                     inserted++;
                 }
                 else
@@ -214,18 +284,16 @@ void write_mmo(Storage *storage, const mmo_storage &s)
                 objs.insert(object.name1);
             for (auto &o : objs)
             {
-                auto iter = find_if(storage->objects.begin(), storage->objects.end(), [&](const auto &p)
-                {
-                    return p.second->text_id == o;
-                });
-                if (iter == storage->objects.end())
+                auto iter = index.objects.find(o);
+                if (iter == index.objects.end())
                 {
                     auto bld = storage->addObject();
                     bld->text_id = o;
                     bld_ids[o] = bld->getId();
+                    index.objects.emplace(o, bld->getId());
                 }
                 else
-                    bld_ids[o] = iter->second->getId();
+                    bld_ids[o] = iter->second;
             }
             for (auto &object : segment->objects)
             {
@@ -243,15 +311,12 @@ void write_mmo(Storage *storage, const mmo_storage &s)
                 mb.pitch = 0;
                 mb.yaw = calc_yaw(object.m_rotate_z);
                 mb.scale = ASSIGN(object.m_rotate_z[2].z, 1);
-                auto i = find_if(storage->mapObjects.begin(), storage->mapObjects.end(), [&](const auto &p)
-                {
-                    return *p.second == mb;
-                });
-                if (i == storage->mapObjects.end())
+                if (!db_index::contains(index.mapObjects, mb))
                 {
                     auto mb2 = storage->addMapObject(storage->maps[map_id]);
                     mb.setId(mb2->getId());
                     *mb2 = mb;
+                    index.mapObjects.emplace(db_index::placement(*mb2), &*mb2);
                     inserted++;
                 }
                 else
@@ -265,6 +330,89 @@ void write_mmo(Storage *storage, const mmo_storage &s)
     std::cout << "inserted: " << inserted << ", exist: " << exist << "\n";
 }
 
+// files are parsed on a thread pool, f gets them on this thread in file order
+// at most 2 files per thread are parsed ahead of f, so memory stays bounded
+template <class F>
+void read_mmo_parallel(const Files &files, size_t threads, bool timings, F &&f)
+{
+    using clock = std::chrono::steady_clock;
+    const std::vector<path> v(files.begin(), files.end());
+    const size_t window = threads * 2;
+
+    std::vector<std::optional<mmo_storage>> parsed(v.size());
+    std::vector<std::exception_ptr> errors(v.size());
+    std::vector<char> done(v.size());
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<int64_t> parse_ns = 0;
+    clock::duration wait{}, merge{};
+    auto start = clock::now();
+
+    Executor e(threads);
+    auto parse = [&](size_t i)
+    {
+        auto t = clock::now();
+        std::optional<mmo_storage> s;
+        std::exception_ptr ep;
+        try
+        {
+            s = read_mmo(v[i]);
+        }
+        catch (...)
+        {
+            ep = std::current_exception();
+        }
+        parse_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count();
+        {
+            std::unique_lock lk(m);
+            parsed[i] = std::move(s);
+            errors[i] = ep;
+            done[i] = 1;
+        }
+        cv.notify_all();
+    };
+
+    try
+    {
+        size_t next = 0;
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            for (; next < v.size() && next < i + window; next++)
+                e.push([&parse, next]() { parse(next); });
+
+            auto t = clock::now();
+            {
+                std::unique_lock lk(m);
+                cv.wait(lk, [&done, i] { return done[i] != 0; });
+            }
+            wait += clock::now() - t;
+            if (errors[i])
+                std::rethrow_exception(errors[i]);
+
+            t = clock::now();
+            std::cerr << "processing: " << v[i] << "\n";
+            f(v[i], *parsed[i]);
+            parsed[i].reset();
+            merge += clock::now() - t;
+        }
+    }
+    catch (...)
+    {
+        // parsers still reference the state above
+        e.wait();
+        throw;
+    }
+
+    if (timings)
+    {
+        using seconds = std::chrono::duration<double>;
+        std::cerr << "parse: " << parse_ns / 1e9 << " s on " << threads << " threads"
+            << ", merge: " << seconds(merge).count() << " s"
+            << ", waiting for parsers: " << seconds(wait).count() << " s"
+            << ", total: " << seconds(clock::now() - start).count() << " s\n";
+    }
+}
+
 int main(int argc, char *argv[])
 {
     cl::opt<bool> m2("m2", cl::desc("m2 .mmo file"));
@@ -272,23 +420,23 @@ int main(int argc, char *argv[])
     cl::opt<path> db_path("db", cl::desc("database file"));
     cl::alias db_pathA("d", cl::aliasopt(db_path));
     cl::opt<path> p(cl::Positional, cl::desc("<.mmo file or directory with .mmo files>"), cl::value_desc("file or directory"), cl::Required);
+    cl::opt<int> jobs("j", cl::desc("number of threads parsing .mmo files in a directory, 0 means all cores"), cl::init(0));
+    cl::opt<bool> timings("time", cl::desc("print time spent in parsing and merging"));
 
     cl::ParseCommandLineOptions(argc, argv);
 
     gameType = m2 ? GameType::Aim2 : GameType::Aim1;
 
-    auto action = [&p](auto f)
+    // parsing is independent per file, f (the database merge) runs in file order on this thread
+    auto action = [&p, &jobs, &timings](auto f)
     {
         if (fs::is_regular_file(p))
             f(p, read_mmo(p));
         else if (fs::is_directory(p))
         {
             auto files = enumerate_files_like(p, ".*\\.[Mm][Mm][Oo]", false);
-            for (auto &file : files)
-            {
-                std::cerr << "processing: " << file << "\n";
-                f(file, read_mmo(file));
-            }
+            size_t threads = jobs > 0 ? (size_t)jobs : std::max(1u, std::thread::hardware_concurrency());
+            read_mmo_parallel(files, threads, timings, f);
         }
         else
             throw std::runtime_error("Bad fs object");
@@ -322,7 +470,8 @@ int main(int argc, char *argv[])
             storage->save();
         }
         storage->load();
-        action([&storage](const path &, const auto &m) {write_mmo(storage.get(), m); });
+        db_index index(*storage);
+        action([&storage, &index](const path &, const auto &m) {write_mmo(storage.get(), index, m); });
         if (inserted_all)
             storage->save();
     }
@@ -20,17 +20,26 @@
 
 #include "mmp.h"
 
+#include <parallel.h>
+#include <simd.h>
+
 #include <primitives/filesystem.h>
 #include <primitives/exceptions.h>
 #include <primitives/sw/cl.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <string.h>
+#include <unordered_map>
 
 cl::list<int> extend("e", cl::desc("try to extend map for ue4"), cl::value_desc("<quads per section> <sections per component>"), cl::multi_val(2));
+cl::opt<float> mesh_error("mesh_error", cl::desc("max height error of the adaptive terrain mesh"), cl::init(0.1f));
 
 void water_segment::load(const buffer &b)
 {
@@ -93,15 +102,69 @@ void segment::load(const buffer &b)
     uint32_t offset;
     READ(b, offset);
     READ(b, desc);
-    buffer b2(b);
-    b2.seek(offset);
-    READ(b2, d);
-    b2.seek(offset);
-    READ(b2, d2);
+    if (offset + sizeof(data) > b.buf().size())
+        throw std::logic_error("segment data is out of file");
+    ptr = b.buf().data() + offset;
+    if ((uintptr_t)ptr % alignof(data) != 0)
+    {
+        aligned_copy = std::make_unique<data>();
+        memcpy(aligned_copy.get(), ptr, sizeof(data));
+        ptr = (const uint8_t *)aligned_copy.get();
+    }
+}
+
+alpha_map::alpha_map(int w, int h)
+{
+    width = w < 0 ? 0 : w;
+    height = h < 0 ? 0 : h;
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    tiles.resize(tiles_x * tiles_y);
+}
+
+void alpha_map::allocate(int row1, int col1, int row2, int col2)
+{
+    row1 = std::max(row1, 0);
+    col1 = std::max(col1, 0);
+    row2 = std::min(row2, height);
+    col2 = std::min(col2, width);
+    if (row1 >= row2 || col1 >= col2)
+        return;
+    for (int r = row1 / tile_size; r <= (row2 - 1) / tile_size; r++)
+    {
+        for (int c = col1 / tile_size; c <= (col2 - 1) / tile_size; c++)
+        {
+            auto &t = tiles[r * tiles_x + c];
+            if (!t)
+                t = std::make_unique<uint8_t[]>(tile_size * tile_size);
+        }
+    }
+}
+
+void alpha_map::set(int row, int col, uint8_t v)
+{
+    assert(!(row >= height || col >= width || row < 0 || col < 0));
+    auto &t = tiles[row / tile_size * tiles_x + col / tile_size];
+    if (!t)
+    {
+        if (!v)
+            return;
+        t = std::make_unique<uint8_t[]>(tile_size * tile_size);
+    }
+    t[row % tile_size * tile_size + col % tile_size] = v;
+}
+
+uint8_t alpha_map::get(int row, int col) const
+{
+    auto &t = tiles[row / tile_size * tiles_x + col / tile_size];
+    if (!t)
+        return 0;
+    return t[row % tile_size * tile_size + col % tile_size];
 }
 
 void mmp::load(const buffer &b)
 {
+    file = b;
     h.load(b);
     xsegs = (h.width - 1) / 64;
     if ((h.width - 1) % 64 != 0)
@@ -147,12 +210,61 @@ static bool is_power_of_two(int x)
     return x != 0 && (x & (x - 1)) == 0;
 }
 
+// segments cover disjoint rectangles of the maps, so they are visited in parallel
+// f(segment index, segment data, index in data, row, col), rows are not reversed
+template <class F>
+void mmp::forEachPixel(F &&f) const
+{
+    parallel_for(segments.size(), [this, &f](size_t i)
+    {
+        auto &s = segments[i];
+        const auto &data = s.getData();
+        int y1 = s.desc.min.y / 10;
+        int y2 = s.desc.max.y / 10;
+        if (y2 > (int)h.length)
+            y2 = h.length;
+        for (int y = 0; y1 < y2; y1++, y++)
+        {
+            int x1 = s.desc.min.x / 10;
+            int x2 = s.desc.max.x / 10;
+            auto dx = x2 - x1;
+            if (x2 > (int)h.width)
+                x2 = h.width;
+            for (int x = 0; x1 < x2; x1++, x++)
+                f(i, data, y * dx + x, y1, x1);
+        }
+    });
+}
+
 void mmp::process()
 {
-    for (auto &s : segments)
+    // texture histogram, reduced from parallel chunks
+    // texture ids are 12 bit, so dense arrays are used instead of maps
     {
-        for (auto &i : s.d.Infomap)
-            textures[i.getTexture()]++;
+        const size_t chunk = 64;
+        std::vector<std::vector<int>> hists((segments.size() + chunk - 1) / chunk);
+        parallel_for(hists.size(), [this, &hists, chunk](size_t c)
+        {
+            auto &hist = hists[c];
+            hist.resize(segment::info::max_textures);
+            auto end = std::min(segments.size(), (c + 1) * chunk);
+            for (auto i = c * chunk; i < end; i++)
+            {
+                for (auto &info : segments[i].getData().Infomap)
+                    hist[info.getTexture()]++;
+            }
+        });
+        std::vector<int> hist(segment::info::max_textures);
+        for (auto &h : hists)
+        {
+            for (int t = 0; t < segment::info::max_textures; t++)
+                hist[t] += h[t];
+        }
+        for (int t = 0; t < segment::info::max_textures; t++)
+        {
+            if (hist[t])
+                textures[t] = hist[t];
+        }
     }
     textures.erase(0);
     auto textures_per_color = std::max<size_t>(1U, textures.size() / 3);
@@ -174,14 +286,6 @@ void mmp::process()
         c2.g = 255 - i * color_step;
         textures_map[iter->first] = c2;
     }
-    alpha_maps[0] = mat<uint32_t>(h.width, h.length);
-    for (auto &t : textures_map)
-    {
-        alpha_maps[t.second.g] = mat<uint32_t>(h.width, h.length);
-    }
-
-    auto wnew = h.width;
-    auto lnew = h.length;
 
     if (extend.empty())
     {
@@ -215,63 +319,31 @@ void mmp::process()
                 std::to_string(wcomps) + "x" + std::to_string(lcomps) + " = " + std::to_string(wcomps * lcomps) + " components");
         }
 
-        wnew = wcomps * mult + 1;
-        lnew = lcomps * mult + 1;
+        quads_per_section = quads_per_sect - 1;
+        sections_per_component = sections_per_comp;
+        component_quads = mult;
+        this->wcomps = wcomps;
+        this->lcomps = lcomps;
     }
 
-    // merge
-    heightmap = decltype(heightmap)(wnew, lnew);
-    heightmap32 = decltype(heightmap32)(h.width, h.length);
-    //heightmap_segmented = decltype(heightmap)(segment::len, h.length);
-    texmap = decltype(texmap)(h.width, h.length);
-    texmap_colored = decltype(texmap_colored)(h.width, h.length);
-    colormap = decltype(colormap)(h.width, h.length);
-    shadowmap = decltype(shadowmap)(h.width, h.length);
-    normalmap = decltype(normalmap)(h.width, h.length);
+    // heights range
+    std::vector<std::pair<Height, Height>> minmax(segments.size(),
+        { std::numeric_limits<Height>::max(), std::numeric_limits<Height>::min() });
+    forEachPixel([&minmax](size_t i, const segment::data &data, int p, int, int)
+    {
+        auto &[h_min, h_max] = minmax[i];
+        h_min = std::min(h_min, data.Heightmap[p]);
+        h_max = std::max(h_max, data.Heightmap[p]);
+    });
 
     h_min = std::numeric_limits<Height>::max();
     h_max = std::numeric_limits<Height>::min();
-    for (auto &s : segments)
+    for (auto &[min, max] : minmax)
     {
-        const auto &data = s.d;
-        int y1 = s.desc.min.y / 10;
-        int y2 = s.desc.max.y / 10;
-        if (y2 > (int)h.length)
-            y2 = h.length;
-        for (int y = 0; y1 < y2; y1++, y++)
-        {
-            int x1 = s.desc.min.x / 10;
-            int x2 = s.desc.max.x / 10;
-            auto dx = x2 - x1;
-            if (x2 >(int)h.width)
-                x2 = h.width;
-            for (int x = 0; x1 < x2; x1++, x++)
-            {
-                auto p = y * dx + x;
-                auto y_rev = h.length - y1 - 1; // for bmp reversion
-                //auto y_rev = y1;
-
-                auto t = data.Infomap[p].getTexture();
-                auto t_norm = textures_map.find(t);
-                if (t_norm != textures_map.end())
-                {
-                    texmap(y_rev, x1) = t_norm->second;
-                    alpha_maps[t_norm->second.g](y_rev, x1) = color{ 0,255,0,0 };
-                }
-
-                texmap_colored(y_rev, x1) = textures_map_colored[t];
-                colormap(y_rev, x1) = data.Colormap[p];
-                shadowmap(y_rev, x1) = *(uint32_t*)&data.Shadowmap[p];
-                normalmap(y_rev, x1) = *(uint32_t*)&data.Normalmap[p];
-
-                auto length = data.Heightmap[p];
-                h_min = std::min(h_min, length);
-                h_max = std::max(h_max, length);
-            }
-        }
+        h_min = std::min(h_min, min);
+        h_max = std::max(h_max, max);
     }
 
-    alpha_maps.erase(0);
     scale16 = 0xffff / (h_max - h_min);
     // 51300 = -25600..25600? or 51200 = -25500..25600
     // seems like 51300
@@ -279,32 +351,174 @@ void mmp::process()
     const int aim_koef = 10;
     const double diff = h_max - h_min;
     scale = aim_koef * diff / unreal_koef;
+}
 
-    // make heightmap
-    for (auto &s : segments)
+// maps below are built on first use, so only requested outputs are computed
+
+void mmp::buildHeightMap()
+{
+    auto wnew = h.width;
+    auto lnew = h.length;
+    if (component_quads)
     {
-        int y1 = s.desc.min.y / 10;
-        int y2 = s.desc.max.y / 10;
-        if (y2 > (int)h.length)
-            y2 = h.length;
-        for (int y = 0; y1 < y2; y1++, y++)
+        wnew = wcomps * component_quads + 1;
+        lnew = lcomps * component_quads + 1;
+    }
+    heightmap = decltype(heightmap)(wnew, lnew);
+    heightmap32 = decltype(heightmap32)(h.width, h.length);
+    forEachPixel([this](size_t, const segment::data &data, int p, int y1, int x1)
+    {
+        auto height = data.Heightmap[p];
+        heightmap32(y1, x1) = height; // dunno what is right
+        heightmap32(y1, x1) = height - h_min; // dunno what is right
+        auto val = (height - h_min) * scale16 * scale;
+        auto &old_height = heightmap(y1, x1);
+        old_height = val;
+    });
+}
+
+void mmp::buildTextureMaps()
+{
+    alpha_maps.clear();
+    alpha_maps[0] = alpha_map(h.width, h.length);
+    for (auto &t : textures_map)
+    {
+        alpha_maps[t.second.g] = alpha_map(h.width, h.length);
+    }
+
+    // lookup tables for the pixel loop
+    // unknown ids (0) write zeroes to texmap and texmap_colored (as they were left before)
+    // and mark alpha_maps[0], which is dropped afterwards
+    std::vector<uint32_t> texmap_lut(segment::info::max_textures);
+    std::vector<uint32_t> texmap_colored_lut(segment::info::max_textures);
+    std::vector<alpha_map *> alpha_maps_lut(segment::info::max_textures, &alpha_maps[0]);
+    for (auto &[t, c] : textures_map)
+    {
+        texmap_lut[t] = c;
+        alpha_maps_lut[t] = &alpha_maps[c.g];
+    }
+    for (auto &[t, c] : textures_map_colored)
+        texmap_colored_lut[t] = c;
+
+    // segment rectangles come from the file and do not have to match the tiles,
+    // so tiles written by every segment are allocated before set() is called in parallel
+    std::vector<std::vector<alpha_map *>> used_maps(segments.size());
+    forEachPixel([&](size_t i, const segment::data &data, int p, int, int)
+    {
+        auto m = alpha_maps_lut[data.Infomap[p].getTexture()];
+        auto &u = used_maps[i];
+        if (std::find(u.begin(), u.end(), m) == u.end())
+            u.push_back(m);
+    });
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        auto &d = segments[i].desc;
+        for (auto m : used_maps[i])
+            m->allocate(d.min.y / 10, d.min.x / 10, d.max.y / 10, d.max.x / 10);
+    }
+
+    texmap = decltype(texmap)(h.width, h.length);
+    texmap_colored = decltype(texmap_colored)(h.width, h.length);
+    // for bmp reversion
+    auto texmap_rev = texmap.view().flipped();
+    auto texmap_colored_rev = texmap_colored.view().flipped();
+    forEachPixel([&](size_t, const segment::data &data, int p, int y1, int x1)
+    {
+        auto t = data.Infomap[p].getTexture();
+        texmap_rev(y1, x1) = texmap_lut[t];
+        alpha_maps_lut[t]->set(y1, x1); // not reversed, see writeTextureAlphaMaps()
+        texmap_colored_rev(y1, x1) = texmap_colored_lut[t];
+    });
+    alpha_maps.erase(0);
+}
+
+// times the std::map lookups the pixel loop used before against the dense tables it uses now,
+// both visit every info entry of every segment on one thread and must find the same values
+void mmp::compareTextureLookups()
+{
+    if (alpha_maps.empty())
+        buildTextureMaps();
+
+    std::vector<uint32_t> texmap_lut(segment::info::max_textures);
+    std::vector<uint32_t> texmap_colored_lut(segment::info::max_textures);
+    std::vector<const alpha_map *> alpha_maps_lut(segment::info::max_textures);
+    for (auto &[t, c] : textures_map)
+    {
+        texmap_lut[t] = c;
+        alpha_maps_lut[t] = &alpha_maps.find(c.g)->second;
+    }
+    for (auto &[t, c] : textures_map_colored)
+        texmap_colored_lut[t] = c;
+
+    // best of 3, the checksum keeps the lookups from being optimized away
+    auto run = [this](const String &name, auto &&lookup)
+    {
+        uint64_t sum = 0;
+        double best = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; i++)
         {
-            int x1 = s.desc.min.x / 10;
-            int x2 = s.desc.max.x / 10;
-            auto dx = x2 - x1;
-            if (x2 > (int)h.width)
-                x2 = h.width;
-            for (int x = 0; x1 < x2; x1++, x++)
+            sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (auto &s : segments)
             {
-                auto height = s.d.Heightmap[y * dx + x];
-                heightmap32(y1, x1) = height; // dunno what is right
-                heightmap32(y1, x1) = height - h_min; // dunno what is right
-                auto val = (height - h_min) * scale16 * scale;
-                auto &old_height = heightmap(y1, x1);
-                old_height = val;
+                for (auto &info : s.getData().Infomap)
+                    sum = sum * 31 + lookup(info.getTexture());
             }
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+            best = std::min(best, t.count());
         }
-    }
+        std::cout << name << ": " << best << " s\n";
+        return sum;
+    };
+    auto map_sum = run("std::map lookups", [this](int t) -> uint64_t
+    {
+        uint64_t r = 0;
+        auto t_norm = textures_map.find(t);
+        if (t_norm != textures_map.end())
+        {
+            r += t_norm->second.data;
+            r += (uintptr_t)&alpha_maps.find(t_norm->second.g)->second;
+        }
+        auto t_colored = textures_map_colored.find(t);
+        r += t_colored != textures_map_colored.end() ? t_colored->second.data : 0;
+        return r;
+    });
+    auto table_sum = run("dense tables", [&texmap_lut, &texmap_colored_lut, &alpha_maps_lut](int t) -> uint64_t
+    {
+        return texmap_lut[t] + (uintptr_t)alpha_maps_lut[t] + texmap_colored_lut[t];
+    });
+    if (map_sum != table_sum)
+        throw std::logic_error("dense texture tables differ from std::map lookups");
+}
+
+void mmp::buildColorMap()
+{
+    colormap = decltype(colormap)(h.width, h.length);
+    auto v = colormap.view().flipped(); // for bmp reversion
+    forEachPixel([&v](size_t, const segment::data &data, int p, int y1, int x1)
+    {
+        v(y1, x1) = data.Colormap[p];
+    });
+}
+
+void mmp::buildShadowMap()
+{
+    shadowmap = decltype(shadowmap)(h.width, h.length);
+    auto v = shadowmap.view().flipped(); // for bmp reversion
+    forEachPixel([&v](size_t, const segment::data &data, int p, int y1, int x1)
+    {
+        v(y1, x1) = *(uint32_t*)&data.Shadowmap[p];
+    });
+}
+
+void mmp::buildNormalMap()
+{
+    normalmap = decltype(normalmap)(h.width, h.length);
+    auto v = normalmap.view().flipped(); // for bmp reversion
+    forEachPixel([&v](size_t, const segment::data &data, int p, int y1, int x1)
+    {
+        v(y1, x1) = *(uint32_t*)&data.Normalmap[p];
+    });
 }
 
 void mmp::writeFileInfo()
@@ -322,6 +536,12 @@ void mmp::writeFileInfo()
     ofile << "h_diff: " << h_max - h_min << "\n";
     ofile << "scale16: " << scale16 << "\n";
     ofile << "scale: " << scale * 100 << "\n";
+    if (component_quads)
+    {
+        ofile << "quads per section: " << quads_per_section << "\n";
+        ofile << "sections per component: " << sections_per_component * sections_per_component << "\n";
+        ofile << "components: " << wcomps << "x" << lcomps << "\n";
+    }
 }
 
 void mmp::writeTexturesList()
@@ -346,42 +566,71 @@ void mmp::writeTexturesList()
     }
 }
 
+// wraps the data, no copy is made, so it must outlive the result
 static cv::Mat toCvMat(const mat<uint16_t> &in)
 {
-    int cols = in.getWidth();
-    int rows = in.getHeight();
-    cv::Mat m(in.getHeight(), in.getWidth(), CV_16UC1);
-    for (int row = 0; row < rows; row++)
+    return cv::Mat(in.getHeight(), in.getWidth(), CV_16UC1, (void *)in.getRow(0), in.getStride());
+}
+
+#ifdef AIM_X86
+// 16 pixels per step, 4 shuffles combined into 3 stores
+// returns the number of converted pixels, the caller finishes the tail
+AIM_TARGET_SSSE3
+static int bgra_to_bgr_ssse3(const uint32_t *in, uint8_t *out, int n)
+{
+    int i = 0;
+    const auto s0 = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const auto s1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 2, 4);
+    const auto s2 = _mm_setr_epi8(5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    const auto s3 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9);
+    const auto s4 = _mm_setr_epi8(10, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const auto s5 = _mm_setr_epi8(-1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14);
+    for (; i + 16 <= n; i += 16)
     {
-        for (int col = 0; col < cols; col++)
-        {
-            auto &o = in(row * cols + col);
-            m.ptr<uint16_t>(row)[col] = o;
-        }
+        auto a = _mm_loadu_si128((const __m128i *)(in + i));
+        auto b = _mm_loadu_si128((const __m128i *)(in + i + 4));
+        auto c = _mm_loadu_si128((const __m128i *)(in + i + 8));
+        auto d = _mm_loadu_si128((const __m128i *)(in + i + 12));
+        auto o = (__m128i *)(out + i * 3);
+        _mm_storeu_si128(o + 0, _mm_or_si128(_mm_shuffle_epi8(a, s0), _mm_shuffle_epi8(b, s1)));
+        _mm_storeu_si128(o + 1, _mm_or_si128(_mm_shuffle_epi8(b, s2), _mm_shuffle_epi8(c, s3)));
+        _mm_storeu_si128(o + 2, _mm_or_si128(_mm_shuffle_epi8(c, s4), _mm_shuffle_epi8(d, s5)));
+    }
+    return i;
+}
+#endif
+
+// drops alpha: 4 bytes bgra -> 3 bytes bgr
+static void bgra_to_bgr(const uint32_t *in, uint8_t *out, int n)
+{
+    int i = 0;
+#ifdef AIM_X86
+    if (cpu_has_ssse3)
+        i = bgra_to_bgr_ssse3(in, out, n);
+#endif
+    for (; i < n; i++)
+    {
+        out[3 * i + 0] = (in[i] >> 0) & 0xFF;
+        out[3 * i + 1] = (in[i] >> 8) & 0xFF;
+        out[3 * i + 2] = (in[i] >> 16) & 0xFF;
     }
-    return m;
 }
 
 static cv::Mat toCvMat(const mat<uint32_t> &in)
 {
-    int cols = in.getWidth();
-    int rows = in.getHeight();
     cv::Mat m(in.getHeight(), in.getWidth(), CV_8UC3);
-    for (int row = 0; row < rows; row++)
+    parallel_for(in.getHeight(), [&in, &m](size_t row)
     {
-        for (int col = 0; col < cols; col++)
-        {
-            auto &o = in(row * cols + col);
-            m.ptr<uint8_t>(row)[3 * col + 2] = (o >> 16) & 0xFF;
-            m.ptr<uint8_t>(row)[3 * col + 1] = (o >> 8) & 0xFF;
-            m.ptr<uint8_t>(row)[3 * col + 0] = (o >> 0) & 0xFF;
-        }
-    }
+        bgra_to_bgr(in.getRow(row), m.ptr<uint8_t>(row), in.getWidth());
+    });
     return m;
 }
 
 void mmp::writeHeightMap()
 {
+    if (!heightmap32.size())
+        buildHeightMap();
+
     auto write_hm = [this](const String &name, const auto &v, auto sz)
     {
         auto fn = filename;
@@ -399,6 +648,168 @@ void mmp::writeHeightMap()
     write_hm(".heightmap32.r32", heightmap32, sizeof(decltype(heightmap32)::type));
 }
 
+// one 2x2 step of the mean/min/max pyramids, odd edges are clamped
+static void reduce_heights(const mat<float> &mean, const mat<float> &min, const mat<float> &max,
+    mat<float> &mean2, mat<float> &min2, mat<float> &max2)
+{
+    int w = mean.getWidth();
+    int h = mean.getHeight();
+    int w2 = (w + 1) / 2;
+    int h2 = (h + 1) / 2;
+    mean2 = mat<float>(w2, h2);
+    min2 = mat<float>(w2, h2);
+    max2 = mat<float>(w2, h2);
+    parallel_for(h2, [&](size_t row)
+    {
+        int r0 = row * 2;
+        int r1 = std::min(r0 + 1, h - 1);
+        auto a = &mean(r0, 0), b = &mean(r1, 0);
+        auto amin = &min(r0, 0), bmin = &min(r1, 0);
+        auto amax = &max(r0, 0), bmax = &max(r1, 0);
+        auto omean = &mean2(row, 0), omin = &min2(row, 0), omax = &max2(row, 0);
+        int col = 0;
+#ifdef AIM_SSE2
+        // 4 output texels from 8 input columns of both rows
+        for (; col + 4 <= w / 2; col += 4)
+        {
+            auto even = [](const float *p) { return _mm_shuffle_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _MM_SHUFFLE(2, 0, 2, 0)); };
+            auto odd = [](const float *p) { return _mm_shuffle_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _MM_SHUFFLE(3, 1, 3, 1)); };
+            int c = col * 2;
+            auto sum = _mm_add_ps(_mm_add_ps(even(a + c), odd(a + c)), _mm_add_ps(even(b + c), odd(b + c)));
+            _mm_storeu_ps(omean + col, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+            _mm_storeu_ps(omin + col, _mm_min_ps(_mm_min_ps(even(amin + c), odd(amin + c)), _mm_min_ps(even(bmin + c), odd(bmin + c))));
+            _mm_storeu_ps(omax + col, _mm_max_ps(_mm_max_ps(even(amax + c), odd(amax + c)), _mm_max_ps(even(bmax + c), odd(bmax + c))));
+        }
+#endif
+        for (; col < w2; col++)
+        {
+            int c0 = col * 2;
+            int c1 = std::min(c0 + 1, w - 1);
+            omean[col] = (a[c0] + a[c1] + b[c0] + b[c1]) * 0.25f;
+            omin[col] = std::min(std::min(amin[c0], amin[c1]), std::min(bmin[c0], bmin[c1]));
+            omax[col] = std::max(std::max(amax[c0], amax[c1]), std::max(bmax[c0], bmax[c1]));
+        }
+    });
+}
+
+void mmp::buildHeightPyramid()
+{
+    if (!heightmap32.size())
+        buildHeightMap();
+
+    // level 0 is heightmap32 itself
+    height_mips.clear();
+    height_mins.clear();
+    height_maxs.clear();
+    auto *mean = &heightmap32, *min = &heightmap32, *max = &heightmap32;
+    while (mean->getWidth() > 1 || mean->getHeight() > 1)
+    {
+        mat<float> mean2, min2, max2;
+        reduce_heights(*mean, *min, *max, mean2, min2, max2);
+        height_mips.push_back(std::move(mean2));
+        height_mins.push_back(std::move(min2));
+        height_maxs.push_back(std::move(max2));
+        mean = &height_mips.back();
+        min = &height_mins.back();
+        max = &height_maxs.back();
+    }
+
+    // quadtree bounds, leaves are segments including their shared border samples
+    height_bounds.clear();
+    mat<float> bmin(xsegs, ysegs), bmax(xsegs, ysegs);
+    parallel_for(xsegs * ysegs, [this, &bmin, &bmax](size_t i)
+    {
+        int sx = i % xsegs;
+        int sy = i / xsegs;
+        auto lo = std::numeric_limits<float>::max();
+        auto hi = std::numeric_limits<float>::lowest();
+        for (int y = sy * 64; y <= std::min(sy * 64 + 64, (int)h.length - 1); y++)
+        {
+            for (int x = sx * 64; x <= std::min(sx * 64 + 64, (int)h.width - 1); x++)
+            {
+                lo = std::min(lo, heightmap32(y, x));
+                hi = std::max(hi, heightmap32(y, x));
+            }
+        }
+        bmin(sy, sx) = lo;
+        bmax(sy, sx) = hi;
+    });
+    while (1)
+    {
+        height_bounds.emplace_back(bmin, bmax);
+        if (bmin.getWidth() == 1 && bmin.getHeight() == 1)
+            break;
+        mat<float> mean2, min2, max2;
+        reduce_heights(bmin, bmin, bmax, mean2, min2, max2);
+        bmin = std::move(min2);
+        bmax = std::move(max2);
+    }
+}
+
+void mmp::writeHeightPyramid()
+{
+    if (height_mips.empty())
+        buildHeightPyramid();
+
+    auto write = [this](const String &name, const mat<float> &m)
+    {
+        auto f = primitives::filesystem::fopen(path(filename) += name, "wb");
+        if (f == nullptr)
+            return;
+        fwrite(&m(0, 0), m.size() * sizeof(float), 1, f);
+        fclose(f);
+    };
+    for (size_t i = 0; i < height_mips.size(); i++)
+    {
+        auto level = std::to_string(i + 1);
+        write(".heightmap32.mip" + level + ".r32", height_mips[i]);
+        write(".heightmap32.mip" + level + ".min.r32", height_mins[i]);
+        write(".heightmap32.mip" + level + ".max.r32", height_maxs[i]);
+    }
+
+    // bounds: n_levels, then for every level from segments up to the root:
+    // width, height, (min, max) * width * height
+    auto f = primitives::filesystem::fopen(path(filename) += ".height_bounds.bin", "wb");
+    if (f == nullptr)
+        return;
+    uint32_t n = height_bounds.size();
+    fwrite(&n, sizeof(n), 1, f);
+    for (auto &[min, max] : height_bounds)
+    {
+        int32_t wh[] = { min.getWidth(), min.getHeight() };
+        fwrite(wh, sizeof(wh), 1, f);
+        for (int i = 0; i < min.size(); i++)
+        {
+            float b[] = { min(i), max(i) };
+            fwrite(b, sizeof(b), 1, f);
+        }
+    }
+    fclose(f);
+}
+
+void mmp::buildTerrainMesh()
+{
+    if (!heightmap32.size())
+        buildHeightMap();
+    // one tile per segment
+    mesh.build(heightmap32, 64, mesh_error);
+}
+
+void mmp::writeTerrainMesh()
+{
+    if (mesh.empty())
+        buildTerrainMesh();
+    mesh.write(path(filename) += ".terrain.mesh");
+}
+
+void mmp::writeTerrainMeshObj()
+{
+    if (mesh.empty())
+        buildTerrainMesh();
+    // same units as segment descriptions
+    mesh.writeObj(path(filename) += ".terrain.obj", 10, h_min);
+}
+
 void mmp::writeHeightMapSegmented()
 {
     /*auto fn = filename + ".heightmap.r16s";
@@ -411,6 +822,9 @@ void mmp::writeHeightMapSegmented()
 
 void mmp::writeTextureMap()
 {
+    if (!texmap.size())
+        buildTextureMaps();
+
     auto fn = filename;
     fn += ".texmap.bmp";
     write_mat_bmp(fn, texmap);
@@ -418,6 +832,9 @@ void mmp::writeTextureMap()
 
 void mmp::writeTextureAlphaMaps()
 {
+    if (!texmap.size())
+        buildTextureMaps();
+
     for (auto &t : alpha_maps)
     {
         int tex_id = 0;
@@ -431,12 +848,42 @@ void mmp::writeTextureAlphaMaps()
         }
         auto fn = filename;
         fn += ".texmap." + std::to_string(t.first) + "." + std::to_string(tex_id) + ".bmp";
-        write_mat_bmp(fn, t.second);
+
+        // stream rows as 32-bit bmp, same output as the old full size maps
+        auto &a = t.second;
+        auto f = primitives::filesystem::fopen(fn, "wb");
+        if (f == nullptr)
+            continue;
+        write_bmp_header(f, a.getWidth(), a.getHeight(), 32, (size_t)a.getWidth() * a.getHeight() * sizeof(uint32_t));
+        const uint32_t set = color{ 0,255,0,0 };
+        const int ts = alpha_map::tile_size;
+        std::vector<uint32_t> row(a.getWidth());
+        for (int y = a.getHeight() - 1; y >= 0; y--) // for bmp reversion
+        {
+            for (int x0 = 0; x0 < a.getWidth(); x0 += ts)
+            {
+                auto n = std::min(ts, a.getWidth() - x0);
+                auto tile = a.getTile(y / ts, x0 / ts);
+                if (!tile)
+                {
+                    std::fill_n(row.begin() + x0, n, 0);
+                    continue;
+                }
+                tile += y % ts * ts;
+                for (int x = 0; x < n; x++)
+                    row[x0 + x] = tile[x] ? set : 0;
+            }
+            fwrite(row.data(), row.size() * sizeof(uint32_t), 1, f);
+        }
+        fclose(f);
     }
 }
 
 void mmp::writeTextureMapColored()
 {
+    if (!texmap.size())
+        buildTextureMaps();
+
     auto fn = filename;
     fn += ".texmap.colored.bmp";
     write_mat_bmp(fn, texmap_colored);
@@ -444,39 +891,143 @@ void mmp::writeTextureMapColored()
 
 void mmp::writeColorMap()
 {
+    if (!colormap.size())
+        buildColorMap();
+
     auto fn = filename;
     fn += ".colormap.bmp";
     write_mat_bmp(fn, colormap);
 }
 
-void mmp::writeSplitColormap() const
+void mmp::writeSplitColormap()
 {
-    std::set<uint32_t> colors;
-    for (auto &pixel : colormap)
-        colors.insert(pixel);
-    int i = 0;
-    for (auto &color : colors)
+    if (!colormap.size())
+        buildColorMap();
+
+    // bucket pixel indices per color in one pass
+    std::unordered_map<uint32_t, std::vector<int>> buckets;
+    for (int i = 0; i < colormap.size(); i++)
+        buckets[colormap(i)].push_back(i);
+
+    struct layer
+    {
+        uint32_t color;
+        path fn;
+        std::string name;
+        const std::vector<int> *pixels;
+    };
+    std::vector<layer> layers;
+    for (auto &[color, pixels] : buckets)
     {
-        ++i;
-        auto fn = filename;
         std::ostringstream ss;
         ss << "0x";
         ss.fill('0');
         ss.width(8);
         ss << std::hex << std::uppercase << color;
+        auto fn = filename;
         fn += ".colormap." + ss.str() + ".png";
-        if (fs::exists(fn))
-            continue;
-        auto m = colormap;
-        for (auto &pixel : m)
-            pixel = pixel == color ? 0x0000FF00 : 0;
-        std::cout << "\r[" << i << "/" << colors.size() << "] Processing color " << ss.str();
-        cv::imwrite((const char *)to_path_string(fn).c_str(), toCvMat(m));
+        layers.push_back({ color, fn, ss.str(), &pixels });
     }
+    std::sort(layers.begin(), layers.end(), [](const auto &a, const auto &b) { return a.color < b.color; });
+    layers.erase(std::remove_if(layers.begin(), layers.end(), [](const auto &l) { return fs::exists(l.fn); }), layers.end());
+
+    // masks are built and encoded in parallel
+    std::atomic<size_t> done = 0;
+    std::mutex m;
+    parallel_for(layers.size(), [this, &layers, &done, &m](size_t i)
+    {
+        auto &l = layers[i];
+        cv::Mat mask = cv::Mat::zeros(colormap.getHeight(), colormap.getWidth(), CV_8UC3);
+        for (auto p : *l.pixels)
+            mask.ptr<uint8_t>(p / colormap.getWidth())[3 * (p % colormap.getWidth()) + 1] = 0xFF;
+        cv::imwrite((const char *)to_path_string(l.fn).c_str(), mask);
+
+        std::unique_lock lk(m);
+        std::cout << "\r[" << ++done << "/" << layers.size() << "] Processed color " << l.name;
+    });
+}
+
+void mmp::writeLandscapeTiles(bool per_section) const
+{
+    if (!component_quads)
+        return;
+
+    // tiles share their border rows/cols like ue landscape components do
+    const int quads = per_section ? quads_per_section : component_quads;
+    const int size = quads + 1;
+    const int ntx = per_section ? wcomps * sections_per_component : wcomps;
+    const int nty = per_section ? lcomps * sections_per_component : lcomps;
+
+    // samples are read from the segments directly, whole maps are not needed
+    std::vector<const segment *> grid(xsegs * ysegs);
+    for (auto &s : segments)
+    {
+        int sx = s.desc.min.x / 10 / 64;
+        int sy = s.desc.min.y / 10 / 64;
+        if (sx >= 0 && sx < xsegs && sy >= 0 && sy < ysegs)
+            grid[sy * xsegs + sx] = &s;
+    }
+    auto sample = [this, &grid](int row, int col, int &p) -> const segment::data *
+    {
+        if (row >= (int)h.length || col >= (int)h.width)
+            return nullptr;
+        auto s = grid[std::min(row / 64, ysegs - 1) * xsegs + std::min(col / 64, xsegs - 1)];
+        if (!s)
+            return nullptr;
+        int x1 = s->desc.min.x / 10;
+        int x2 = s->desc.max.x / 10;
+        int y1 = s->desc.min.y / 10;
+        int y2 = s->desc.max.y / 10;
+        if (col < x1 || col >= x2 || row < y1 || row >= y2)
+            return nullptr;
+        p = (row - y1) * (x2 - x1) + col - x1;
+        return &s->getData();
+    };
+
+    std::vector<char> layers(segment::info::max_textures);
+    for (auto &[t, _] : textures_map)
+        layers[t] = 1;
+
+    // one tile per task, so memory is bounded by the number of workers
+    parallel_for(ntx * nty, [&](size_t i)
+    {
+        int tx = i % ntx;
+        int ty = i / ntx;
+        cv::Mat hm = cv::Mat::zeros(size, size, CV_16UC1);
+        std::map<int, cv::Mat> weights;
+        for (int r = 0; r < size; r++)
+        {
+            for (int c = 0; c < size; c++)
+            {
+                int p;
+                auto data = sample(ty * quads + r, tx * quads + c, p);
+                if (!data)
+                    continue;
+                hm.ptr<uint16_t>(r)[c] = (data->Heightmap[p] - h_min) * scale16 * scale;
+
+                auto t = data->Infomap[p].getTexture();
+                if (!layers[t])
+                    continue;
+                auto w = weights.find(t);
+                if (w == weights.end())
+                    w = weights.emplace(t, cv::Mat::zeros(size, size, CV_8UC1)).first;
+                w->second.ptr<uint8_t>(r)[c] = 0xFF;
+            }
+        }
+
+        auto suffix = "_x" + std::to_string(tx) + "_y" + std::to_string(ty) + ".png";
+        cv::imwrite((const char *)to_path_string(path(filename) += ".heightmap" + suffix).c_str(), hm);
+        // empty weightmaps are not written
+        for (auto &[t, w] : weights)
+            cv::imwrite((const char *)to_path_string(path(filename) += ".weightmap." + std::to_string(t) + suffix).c_str(), w);
+    });
 }
 
 void mmp::writeShadowMap()
 {
+    if (!shadowmap.size())
+        buildShadowMap();
+
     auto fn = filename;
     fn += ".shadowmap.bmp";
     write_mat_bmp(fn, shadowmap);
@@ -484,6 +1035,9 @@ void mmp::writeShadowMap()
 
 void mmp::writeNormalMap()
 {
+    if (!normalmap.size())
+        buildNormalMap();
+
     auto fn = filename;
     fn += ".normalmap.bmp";
     write_mat_bmp(fn, normalmap);
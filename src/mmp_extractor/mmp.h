@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "terrain_mesh.h"
+
 #include <buffer.h>
 #include <color.h>
 #include <mat.h>
@@ -25,6 +27,7 @@
 #include <primitives/filesystem.h>
 
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -100,6 +103,8 @@ struct segment
         uint16_t render_flags;
         uint16_t texture_index;
 
+        static constexpr int max_textures = 0x1000;
+
         uint16_t getTexture() const { return texture_index & 0x0fff; } // first 4 bits are unk (flags?)
     };
 
@@ -156,16 +161,50 @@ struct segment
     };
 
     description desc;
-    data d;
-    data2 d2;
 
     void load(const buffer &b);
+
+    // views into the mmp file data, copied only when the file offset is misaligned
+    const data &getData() const { return *(const data *)ptr; }
+    const data2 &getData2() const { return *(const data2 *)ptr; }
+
+private:
+    const uint8_t *ptr = nullptr;
+    std::unique_ptr<data> aligned_copy;
+};
+static_assert(sizeof(segment::data) == sizeof(segment::data2) && alignof(segment::data) == alignof(segment::data2));
+
+// 8-bit mask stored in fixed size tiles, empty tiles are not allocated
+struct alpha_map
+{
+    static const int tile_size = 64;
+
+    alpha_map(int width = 0, int height = 0);
+
+    // allocates tiles covering rows [row1, row2) and cols [col1, col2)
+    void allocate(int row1, int col1, int row2, int col2);
+    // allocates a missing tile, so it is thread safe only for allocated tiles
+    void set(int row, int col, uint8_t v = 255);
+    uint8_t get(int row, int col) const;
+    // nullptr for empty tiles
+    const uint8_t *getTile(int tile_row, int tile_col) const { return tiles[tile_row * tiles_x + tile_col].get(); }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+private:
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    std::vector<std::unique_ptr<uint8_t[]>> tiles;
 };
 
 struct mmp
 {
     header h;
     std::vector<segment> segments;
+    buffer file; // keeps segment data alive
 
     //
     path filename;
@@ -173,15 +212,28 @@ struct mmp
     int ysegs;
     std::map<int, int /* count */> textures;
     std::map<int, color> textures_map;
-    std::map<int, mat<uint32_t>> alpha_maps;
+    std::map<int, alpha_map> alpha_maps;
     std::map<int, color> textures_map_colored;
     std::map<int, std::string> textures_names;
     Height h_min = 0;
     Height h_max = 0;
     double scale16 = 0;
     double scale = 0;
+    // ue landscape layout, see -e
+    int quads_per_section = 0;
+    int sections_per_component = 0; // per side
+    int component_quads = 0;
+    int wcomps = 0;
+    int lcomps = 0;
     mat<uint16_t> heightmap;
     mat<float> heightmap32;
+    // heightmap32 mip levels 1..n, mean and min/max of the covered samples
+    std::vector<mat<float>> height_mips;
+    std::vector<mat<float>> height_mins;
+    std::vector<mat<float>> height_maxs;
+    // min/max quadtree, from per segment bounds to the root
+    std::vector<std::pair<mat<float>, mat<float>>> height_bounds;
+    terrain_mesh mesh;
     //mat<uint16_t> heightmap_segmented;
     mat<uint32_t> texmap;
     mat<uint32_t> texmap_colored;
@@ -194,16 +246,32 @@ struct mmp
     void loadTextureNames(const path &filename);
 
     void process();
+    void buildHeightMap();
+    void buildHeightPyramid();
+    void buildTerrainMesh();
+    void buildTextureMaps();
+    void compareTextureLookups();
+    void buildColorMap();
+    void buildShadowMap();
+    void buildNormalMap();
 
     void writeFileInfo();
     void writeTexturesList();
     void writeHeightMap();
     void writeHeightMapSegmented();
+    void writeHeightPyramid();
+    void writeTerrainMesh();
+    void writeTerrainMeshObj();
     void writeTextureMap();
     void writeTextureAlphaMaps();
     void writeTextureMapColored();
     void writeColorMap();
     void writeShadowMap();
     void writeNormalMap();
-    void writeSplitColormap() const;
+    void writeSplitColormap();
+    void writeLandscapeTiles(bool per_section = false) const;
+
+private:
+    template <class F>
+    void forEachPixel(F &&f) const;
 };
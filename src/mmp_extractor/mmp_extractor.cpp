@@ -23,6 +23,9 @@
 #include <primitives/sw/settings.h>
 #include <primitives/sw/cl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <set>
 #include <stdint.h>
@@ -37,29 +40,85 @@ int main(int argc, char *argv[])
     cl::opt<path> texture_ids(cl::Positional, cl::desc("<path to texture_ids.txt>"));
     cl::opt<bool> split_colormap("split_colormap", cl::desc("split colormap into separate images"));
     cl::opt<bool> tex_al("texture_alphamaps", cl::desc("write texture alpha maps"));
+    cl::opt<bool> tiles("landscape_tiles", cl::desc("write heightmap and weightmap tiles per landscape component (see -e)"));
+    cl::opt<bool> tiles_per_section("landscape_section_tiles", cl::desc("write landscape tiles per section instead of per component"));
+    cl::opt<bool> compare_lookups("compare_lookups", cl::desc("time the former std::map texture lookups against the dense tables on each map"));
+    cl::opt<bool> timings("time", cl::desc("print time spent in processing, in every writer and in total"));
+    cl::list<String> outputs("outputs", cl::desc("comma separated list of outputs to write, default is all except height_pyramid, terrain meshes, split_colormap, texture_alphamaps and landscape tiles.\n"
+        "Values: info, textures, heightmap, height_pyramid, terrain_mesh, terrain_mesh_obj, texmap, texmap_colored, texture_alphamaps, colormap, split_colormap, shadowmap, normalmap, landscape_tiles, landscape_section_tiles"),
+        cl::CommaSeparated);
 
     cl::ParseCommandLineOptions(argc, argv);
 
-    auto func = [&texture_ids, &split_colormap, &tex_al](auto &p)
+    // maps are computed on first use by their writers, so unused outputs cost nothing
+    std::set<String> out;
+    if (outputs.empty())
+        out = { "info", "textures", "heightmap", "texmap", "texmap_colored", "colormap", "shadowmap", "normalmap" };
+    for (auto &o : outputs)
+        out.insert(o);
+    if (split_colormap)
+        out.insert("split_colormap");
+    if (tex_al)
+        out.insert("texture_alphamaps");
+    if (tiles)
+        out.insert("landscape_tiles");
+    if (tiles_per_section)
+        out.insert("landscape_section_tiles");
+
+    using writer = std::function<void(mmp &)>;
+    const std::vector<std::pair<String, writer>> writers =
+    {
+        { "info", &mmp::writeFileInfo },
+        { "textures", &mmp::writeTexturesList },
+        { "heightmap", &mmp::writeHeightMap },
+        { "height_pyramid", &mmp::writeHeightPyramid },
+        { "terrain_mesh", &mmp::writeTerrainMesh },
+        { "terrain_mesh_obj", &mmp::writeTerrainMeshObj },
+        //{ "heightmap_segmented", &mmp::writeHeightMapSegmented },
+        { "texmap", &mmp::writeTextureMap },
+        { "texture_alphamaps", &mmp::writeTextureAlphaMaps },
+        { "texmap_colored", &mmp::writeTextureMapColored },
+        { "colormap", &mmp::writeColorMap },
+        { "shadowmap", &mmp::writeShadowMap },
+        { "normalmap", &mmp::writeNormalMap },
+        { "split_colormap", &mmp::writeSplitColormap },
+        { "landscape_tiles", [](mmp &m) { m.writeLandscapeTiles(false); } },
+        { "landscape_section_tiles", [](mmp &m) { m.writeLandscapeTiles(true); } },
+    };
+    for (auto &o : out)
+    {
+        if (std::none_of(writers.begin(), writers.end(), [&o](auto &w) { return w.first == o; }))
+            throw std::runtime_error("Unknown output: " + o);
+    }
+
+    auto func = [&texture_ids, &timings, &compare_lookups, &out, &writers](auto &p)
     {
         mmp m;
         if (!texture_ids.empty())
             m.loadTextureNames(texture_ids);
         m.load(p);
+        // writers build the maps they need on first use, so their times include that and file output
+        auto start = std::chrono::steady_clock::now();
+        auto print_time = [&timings](const String &name, auto from)
+        {
+            if (!timings)
+                return;
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - from;
+            std::cout << name << ": " << t.count() << " s\n";
+        };
         m.process();
-        m.writeFileInfo();
-        m.writeTexturesList();
-        m.writeHeightMap();
-        //m.writeHeightMapSegmented();
-        m.writeTextureMap();
-        if (tex_al)
-            m.writeTextureAlphaMaps();
-        m.writeTextureMapColored();
-        m.writeColorMap();
-        m.writeShadowMap();
-        m.writeNormalMap();
-        if (split_colormap)
-            m.writeSplitColormap();
+        print_time("process", start);
+        if (compare_lookups)
+            m.compareTextureLookups();
+        for (auto &[name, w] : writers)
+        {
+            if (!out.count(name))
+                continue;
+            auto wstart = std::chrono::steady_clock::now();
+            w(m);
+            print_time("write " + name, wstart);
+        }
+        print_time("total", start);
     };
 
     if (fs::is_regular_file(p))
@@ -0,0 +1,304 @@
+/*
+ * AIM mmp_extractor
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "terrain_mesh.h"
+
+#include <parallel.h>
+
+#include <algorithm>
+#include <fstream>
+#include <math.h>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace
+{
+
+// triangles of a tile in binary tree order, as (a, b) hypotenuse ends
+// the right angle corner is derived from them
+struct rtin_triangles
+{
+    int tile_size;
+    int grid_size;
+    int n_triangles;
+    int n_parents;
+    std::vector<uint16_t> coords;
+
+    rtin_triangles(int tile_size)
+        : tile_size(tile_size), grid_size(tile_size + 1)
+    {
+        n_triangles = tile_size * tile_size * 2 - 2;
+        n_parents = n_triangles - tile_size * tile_size;
+        coords.resize(n_triangles * 4);
+        for (int i = 0; i < n_triangles; i++)
+        {
+            int id = i + 2;
+            int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+            if (id & 1)
+                bx = by = cx = tile_size;
+            else
+                ax = ay = cy = tile_size;
+            while ((id >>= 1) > 1)
+            {
+                int mx = (ax + bx) >> 1;
+                int my = (ay + by) >> 1;
+                if (id & 1)
+                {
+                    bx = ax; by = ay;
+                    ax = cx; ay = cy;
+                }
+                else
+                {
+                    ax = bx; ay = by;
+                    bx = cx; by = cy;
+                }
+                cx = mx; cy = my;
+            }
+            coords[i * 4 + 0] = ax;
+            coords[i * 4 + 1] = ay;
+            coords[i * 4 + 2] = bx;
+            coords[i * 4 + 3] = by;
+        }
+    }
+
+    // errors[v] is the max error of splitting the triangle that adds vertex v, including its descendants
+    // calling it again after raising some errors propagates them to the parents
+    void propagate(const std::vector<float> &heights, std::vector<float> &errors) const
+    {
+        for (int i = n_triangles - 1; i >= 0; i--)
+        {
+            int ax = coords[i * 4 + 0];
+            int ay = coords[i * 4 + 1];
+            int bx = coords[i * 4 + 2];
+            int by = coords[i * 4 + 3];
+            int mx = (ax + bx) >> 1;
+            int my = (ay + by) >> 1;
+            int cx = mx + my - ay;
+            int cy = my + ax - mx;
+
+            auto interpolated = (heights[ay * grid_size + ax] + heights[by * grid_size + bx]) / 2;
+            auto m = my * grid_size + mx;
+            auto &e = errors[m];
+            e = std::max(e, fabsf(interpolated - heights[m]));
+            if (i < n_parents)
+            {
+                auto left = ((ay + cy) >> 1) * grid_size + ((ax + cx) >> 1);
+                auto right = ((by + cy) >> 1) * grid_size + ((bx + cx) >> 1);
+                e = std::max(e, std::max(errors[left], errors[right]));
+            }
+        }
+    }
+};
+
+struct rtin_tile
+{
+    int x0;
+    int y0;
+    std::vector<float> heights;
+    std::vector<float> errors;
+    bool dirty = true;
+
+    // local vertex -> x, y in the tile, triangles as local vertex indices
+    std::vector<std::pair<int, int>> vertices;
+    std::vector<uint32_t> indices;
+
+    void extract(int grid_size, float max_error)
+    {
+        std::vector<int> index(grid_size * grid_size, -1);
+        auto add = [this, &index, grid_size](int x, int y)
+        {
+            auto &i = index[y * grid_size + x];
+            if (i == -1)
+            {
+                i = vertices.size();
+                vertices.emplace_back(x, y);
+            }
+            indices.push_back(i);
+        };
+        auto process = [this, &add, grid_size, max_error](auto &&process, int ax, int ay, int bx, int by, int cx, int cy) -> void
+        {
+            int mx = (ax + bx) >> 1;
+            int my = (ay + by) >> 1;
+            if (abs(ax - cx) + abs(ay - cy) > 1 && errors[my * grid_size + mx] > max_error)
+            {
+                process(process, cx, cy, ax, ay, mx, my);
+                process(process, bx, by, cx, cy, mx, my);
+                return;
+            }
+            add(ax, ay);
+            add(bx, by);
+            add(cx, cy);
+        };
+        int t = grid_size - 1;
+        process(process, 0, 0, t, t, t, 0);
+        process(process, t, t, 0, 0, 0, t);
+    }
+};
+
+}
+
+void terrain_mesh::build(const mat<float> &heightmap, int tile_size, float max_error)
+{
+    if (tile_size < 2 || (tile_size & (tile_size - 1)))
+        throw std::logic_error("terrain_mesh: tile size must be 2^n");
+
+    vertices.clear();
+    indices.clear();
+
+    int w = heightmap.getWidth();
+    int h = heightmap.getHeight();
+    if (w < 2 || h < 2)
+        return;
+
+    const rtin_triangles tris(tile_size);
+    const int grid_size = tris.grid_size;
+    int tiles_x = (w - 1 + tile_size - 1) / tile_size;
+    int tiles_y = (h - 1 + tile_size - 1) / tile_size;
+
+    // samples outside of the map repeat its edge
+    std::vector<rtin_tile> tiles(tiles_x * tiles_y);
+    parallel_for(tiles.size(), [&](size_t i)
+    {
+        auto &t = tiles[i];
+        t.x0 = i % tiles_x * tile_size;
+        t.y0 = i / tiles_x * tile_size;
+        t.heights.resize(grid_size * grid_size);
+        t.errors.resize(grid_size * grid_size);
+        for (int y = 0; y < grid_size; y++)
+        {
+            for (int x = 0; x < grid_size; x++)
+                t.heights[y * grid_size + x] = heightmap(std::min(t.y0 + y, h - 1), std::min(t.x0 + x, w - 1));
+        }
+    });
+
+    // a border vertex is used when its error is above max_error, so both tiles must see the same error
+    // raising it changes the parents' errors, which may raise other border vertices: repeat until stable
+    while (1)
+    {
+        parallel_for(tiles.size(), [&tiles, &tris](size_t i)
+        {
+            auto &t = tiles[i];
+            if (t.dirty)
+                tris.propagate(t.heights, t.errors);
+            t.dirty = false;
+        });
+
+        bool changed = false;
+        auto sync = [&changed](rtin_tile &a, int ia, rtin_tile &b, int ib)
+        {
+            auto &ea = a.errors[ia];
+            auto &eb = b.errors[ib];
+            if (ea == eb)
+                return;
+            ea = eb = std::max(ea, eb);
+            a.dirty = b.dirty = changed = true;
+        };
+        for (int ty = 0; ty < tiles_y; ty++)
+        {
+            for (int tx = 0; tx < tiles_x; tx++)
+            {
+                auto &t = tiles[ty * tiles_x + tx];
+                for (int k = 1; k < tile_size; k++)
+                {
+                    if (tx + 1 < tiles_x)
+                        sync(t, k * grid_size + tile_size, tiles[ty * tiles_x + tx + 1], k * grid_size);
+                    if (ty + 1 < tiles_y)
+                        sync(t, tile_size * grid_size + k, tiles[(ty + 1) * tiles_x + tx], k);
+                }
+            }
+        }
+        if (!changed)
+            break;
+    }
+
+    parallel_for(tiles.size(), [&tiles, grid_size, max_error](size_t i)
+    {
+        tiles[i].extract(grid_size, max_error);
+    });
+
+    // merge, welding vertices on tile borders
+    std::unordered_map<uint32_t, uint32_t> border;
+    std::vector<uint32_t> remap;
+    for (auto &t : tiles)
+    {
+        remap.resize(t.vertices.size());
+        for (size_t i = 0; i < t.vertices.size(); i++)
+        {
+            auto [x, y] = t.vertices[i];
+            int gx = std::min(t.x0 + x, w - 1);
+            int gy = std::min(t.y0 + y, h - 1);
+            bool on_border = x == 0 || y == 0 || x == tile_size || y == tile_size;
+            if (on_border)
+            {
+                auto [it, inserted] = border.emplace(gy * w + gx, (uint32_t)vertices.size());
+                remap[i] = it->second;
+                if (!inserted)
+                    continue;
+            }
+            else
+                remap[i] = vertices.size();
+            vertices.push_back({ (uint16_t)gx, (uint16_t)gy, heightmap(gy, gx) });
+        }
+        for (size_t i = 0; i < t.indices.size(); i += 3)
+        {
+            auto a = remap[t.indices[i + 0]];
+            auto b = remap[t.indices[i + 1]];
+            auto c = remap[t.indices[i + 2]];
+            // triangles that are outside of the map collapse on its edge
+            auto &va = vertices[a], &vb = vertices[b], &vc = vertices[c];
+            if ((vb.x - va.x) * (vc.y - va.y) == (vb.y - va.y) * (vc.x - va.x))
+                continue;
+            indices.insert(indices.end(), { a, b, c });
+        }
+        t = rtin_tile();
+    }
+}
+
+void terrain_mesh::write(const path &fn) const
+{
+    auto f = primitives::filesystem::fopen(fn, "wb");
+    if (f == nullptr)
+        return;
+    uint32_t version = 1;
+    uint32_t n_vertices = vertices.size();
+    uint32_t n_indices = indices.size();
+    fwrite("TMSH", 4, 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&n_vertices, sizeof(n_vertices), 1, f);
+    fwrite(&n_indices, sizeof(n_indices), 1, f);
+    for (auto &v : vertices)
+    {
+        fwrite(&v.x, sizeof(v.x), 1, f);
+        fwrite(&v.y, sizeof(v.y), 1, f);
+        fwrite(&v.height, sizeof(v.height), 1, f);
+    }
+    fwrite(indices.data(), indices.size() * sizeof(uint32_t), 1, f);
+    fclose(f);
+}
+
+void terrain_mesh::writeObj(const path &fn, float xy_scale, float height_offset) const
+{
+    std::ofstream o(fn);
+    if (!o)
+        return;
+    o << "# " << vertices.size() << " vertices, " << indices.size() / 3 << " triangles\n";
+    for (auto &v : vertices)
+        o << "v " << v.x * xy_scale << " " << v.y * xy_scale << " " << v.height + height_offset << "\n";
+    for (size_t i = 0; i < indices.size(); i += 3)
+        o << "f " << indices[i] + 1 << " " << indices[i + 1] + 1 << " " << indices[i + 2] + 1 << "\n";
+}
@@ -0,0 +1,51 @@
+/*
+ * AIM mmp_extractor
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mat.h>
+
+#include <primitives/filesystem.h>
+
+#include <stdint.h>
+#include <vector>
+
+// adaptive terrain mesh (right triangulated irregular network)
+// see https://www.cs.ubc.ca/~will/papers/rtin.pdf
+struct terrain_mesh
+{
+    struct vertex
+    {
+        uint16_t x; // heightmap column
+        uint16_t y; // heightmap row
+        float height;
+    };
+
+    std::vector<vertex> vertices;
+    std::vector<uint32_t> indices;
+
+    // heightmap is split into tiles of tile_size quads (2^n), tiles are built in parallel
+    // vertices on tile borders are shared, so there are no cracks between tiles
+    void build(const mat<float> &heightmap, int tile_size, float max_error);
+
+    bool empty() const { return indices.empty(); }
+
+    // compact binary mesh: "TMSH", version, n_vertices, n_indices, vertices, indices
+    void write(const path &fn) const;
+    void writeObj(const path &fn, float xy_scale, float height_offset) const;
+};
@@ -6,6 +6,8 @@
 #include <primitives/sw/cl.h>
 #include <fbxsdk.h>
 
+#include <map>
+
 #ifdef IOS_REF
 #undef  IOS_REF
 #define IOS_REF (*(pManager->GetIOSettings()))
@@ -307,7 +309,7 @@ static FbxMesh *create_mesh(FbxScene *s, const block &b)
     return m;
 }
 
-static void set_material(FbxMesh *m, const block &b)
+static FbxSurfacePhong *set_material(FbxMesh *m, const block &b, FbxSurfacePhong *shared = nullptr)
 {
     m->GetNode()->RemoveAllMaterials();
 
@@ -317,7 +319,13 @@ static void set_material(FbxMesh *m, const block &b)
     mat->SetMappingMode(FbxLayerElement::eAllSame);
     mat->SetReferenceMode(FbxLayerElement::eDirect);
 
-    auto lMaterial = FbxSurfacePhong::Create(m->GetNode(), b.h.name.c_str());
+    if (shared)
+    {
+        m->GetNode()->AddMaterial(shared);
+        return shared;
+    }
+
+    auto lMaterial = FbxSurfacePhong::Create(m->GetNode(), b.getMaterialName().c_str());
 
     FbxDouble3 lAmbientColor(b.mat.ambient.r, b.mat.ambient.g, b.mat.ambient.b);
     FbxDouble3 lSpecularColor(b.mat.specular.r, b.mat.specular.g, b.mat.specular.b);
@@ -342,6 +350,7 @@ static void set_material(FbxMesh *m, const block &b)
     lMaterial->SpecularFactor.Set(b.mat.power);
 
     m->GetNode()->AddMaterial(lMaterial);
+    return lMaterial;
 }
 
 static void set_textures(FbxMesh *m, const block &b)
@@ -372,6 +381,7 @@ bool CreateScene(const model &model, const std::string &name, FbxManager* pSdkMa
 
     int engine_id = 0;
     int fx_id = 0;
+    std::map<std::string, FbxSurfacePhong *> materials; // shared ones (atlas)
     for (auto &b : model.blocks)
     {
         auto create_socket_named = [&pScene](const std::string &name)
@@ -428,7 +438,7 @@ bool CreateScene(const model &model, const std::string &name, FbxManager* pSdkMa
             continue;
         }
 
-        if (!b.canPrint())
+        if (!b.canPrint() || b.isInstance())
             continue;
 
         //auto block_name = name + "/" + b.h.name;
@@ -439,9 +449,17 @@ bool CreateScene(const model &model, const std::string &name, FbxManager* pSdkMa
         pScene->GetRootNode()->AddChild(node);
         auto m = create_mesh(pScene, b);
         node->SetNodeAttribute(m);
-        set_material(m, b);
-        if (b.mat_type != MaterialType::MaterialOnly)
-            set_textures(m, b);
+        auto i = materials.find(b.material_name);
+        if (i != materials.end())
+            set_material(m, b, i->second);
+        else
+        {
+            auto mat = set_material(m, b);
+            if (b.mat_type != MaterialType::MaterialOnly)
+                set_textures(m, b);
+            if (!b.material_name.empty())
+                materials[b.material_name] = mat;
+        }
 
         //node->SetShadingMode(FbxNode::eFullShading); // change?! was texture sh
 
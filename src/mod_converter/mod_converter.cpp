@@ -27,11 +27,13 @@
 
 #include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
 
 /*
 TODO:
@@ -45,12 +47,27 @@ bool printMaxPolygonBlock = false;
 
 cl::opt<path> p(cl::Positional, cl::desc("<MOD_ file or directory with MOD_ files or .mod file saved from AIM2 SDK viewer>"), cl::value_desc("file or directory"), cl::Required);
 cl::opt<bool> all_formats("af", cl::desc("All formats (.obj, .fbx)"));
+cl::opt<bool> quantized("q", cl::desc("Also write quantized vertex streams (.qmesh)"));
 // link_faces is not currently complete, after processing we have bad uvs
 cl::opt<bool> link_faces("lf", cl::desc("Link faces (default: true)")/*, cl::init(true)*/);
 
 yaml root;
 cl::opt<bool> stats("i", cl::desc("Gather information from (models)"));
 
+cl::opt<path> atlas_dir("atlas", cl::desc("Pack block textures into atlases, one per group of blocks with equal material parameters"), cl::value_desc("directory with .TM textures"));
+
+cl::opt<bool> dedup("dedup", cl::desc("Write identical blocks only once and reference them from mesh_instances.yml"));
+
+struct mesh_ref
+{
+    std::string model;
+    std::string block;
+    std::string data; // block::hashedData()
+};
+std::unordered_map<uint64_t, mesh_ref> mesh_index;
+yaml instances;
+int n_instances = 0;
+
 // https://twitter.com/FreyaHolmer/status/644881436982575104
 // https://help.autodesk.com/view/FBX/2017/ENU/?guid=__cpp_ref_class_fbx_axis_system_html
 cl::opt<AxisSystem> AS(cl::desc("Choose axis system (.fbx only):"),
@@ -108,11 +125,53 @@ auto read_model(const path &fn)
     return m;
 }
 
+static std::string hash_string(uint64_t h)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << h;
+    return ss.str();
+}
+
+void find_instances(model &m, const path &fn)
+{
+    auto model_name = to_printable_string(fn.filename());
+    for (auto &b : m.blocks)
+    {
+        if (!b.canPrint())
+            continue;
+
+        auto data = b.hashedData();
+        auto h = block::hash(data);
+        auto hs = hash_string(h);
+        auto i = mesh_index.find(h);
+        if (i == mesh_index.end())
+        {
+            mesh_index[h] = { model_name, b.h.name, std::move(data) };
+            instances["meshes"][hs]["model"] = model_name;
+            instances["meshes"][hs]["block"] = b.h.name;
+            continue;
+        }
+
+        auto &ref = i->second;
+        if (ref.data != data)
+        {
+            std::cout << "warning: hash collision for block " << b.h.name << ", exporting as is\n";
+            continue;
+        }
+
+        b.instance_of = ref.model + "/" + ref.block;
+        instances["models"][model_name][b.h.name] = hs;
+        n_instances++;
+    }
+}
+
 void convert_model(const model &m, const path &fn)
 {
     // write all
     if (all_formats)
         m.print(to_printable_string(fn), AS);
+    if (quantized)
+        m.printQuantized(to_printable_string(fn));
     m.printFbx(to_printable_string(fn), AS);
 }
 
@@ -126,6 +185,11 @@ void convert_model(const path &fn)
         return;
     }
 
+    if (dedup)
+        find_instances(m, fn);
+    if (!atlas_dir.empty())
+        m.buildAtlas(atlas_dir, fn);
+
     convert_model(m, fn);
 }
 
@@ -161,6 +225,12 @@ int main(int argc, char *argv[])
     else
         throw std::runtime_error("No such file or directory: " + to_printable_string(normalize_path(p)));
 
+    if (dedup)
+    {
+        std::cout << "instances: " << n_instances << ", unique meshes: " << mesh_index.size() << "\n";
+        write_file((fs::is_regular_file(p) ? path(p) += ".instances.yml" : (p / "mesh_instances.yml")), YAML::Dump(instances));
+    }
+
     if (stats)
     {
         write_file((fs::is_regular_file(p) ? path(p) += ".txt" : (p / "model_information.yml")) , YAML::Dump(root));
@@ -0,0 +1,332 @@
+/*
+ * AIM mod_converter
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model.h"
+
+#include <buffer.h>
+#include <mat.h>
+#include <tm.h>
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <limits.h>
+#include <map>
+#include <math.h>
+#include <string.h>
+
+// skyline bottom-left rectangle packer
+struct skyline_packer
+{
+    struct node
+    {
+        int x;
+        int y;
+        int width;
+    };
+
+    int width;
+    int height;
+    std::vector<node> skyline;
+
+    skyline_packer(int width, int height)
+        : width(width), height(height)
+    {
+        skyline.push_back({ 0, 0, width });
+    }
+
+    bool insert(int w, int h, int &x, int &y)
+    {
+        int best = -1;
+        int best_y = INT_MAX;
+        int best_width = INT_MAX;
+        for (int i = 0; i < (int)skyline.size(); i++)
+        {
+            int fy;
+            if (!fit(i, w, h, fy))
+                continue;
+            if (fy < best_y || (fy == best_y && skyline[i].width < best_width))
+            {
+                best = i;
+                best_y = fy;
+                best_width = skyline[i].width;
+            }
+        }
+        if (best == -1)
+            return false;
+        x = skyline[best].x;
+        y = best_y;
+        add(best, x, y + h, w);
+        return true;
+    }
+
+private:
+    bool fit(int i, int w, int h, int &y) const
+    {
+        if (skyline[i].x + w > width)
+            return false;
+        y = 0;
+        for (int left = w; left > 0; i++)
+        {
+            y = std::max(y, skyline[i].y);
+            if (y + h > height)
+                return false;
+            left -= skyline[i].width;
+        }
+        return true;
+    }
+
+    void add(int i, int x, int y, int w)
+    {
+        skyline.insert(skyline.begin() + i, { x, y, w });
+
+        // cut nodes under the new one
+        for (int j = i + 1; j < (int)skyline.size();)
+        {
+            auto end = skyline[j - 1].x + skyline[j - 1].width;
+            auto &n = skyline[j];
+            if (n.x >= end)
+                break;
+            auto cut = end - n.x;
+            n.x += cut;
+            n.width -= cut;
+            if (n.width > 0)
+                break;
+            skyline.erase(skyline.begin() + j);
+        }
+
+        // merge same level nodes
+        for (int j = 0; j + 1 < (int)skyline.size();)
+        {
+            if (skyline[j].y == skyline[j + 1].y)
+            {
+                skyline[j].width += skyline[j + 1].width;
+                skyline.erase(skyline.begin() + j + 1);
+            }
+            else
+                j++;
+        }
+    }
+};
+
+static bool can_use_atlas(const block &b)
+{
+    if (!b.canPrint() || b.isInstance())
+        return false;
+    if (b.h.mask.name.empty() || b.h.mask.name == "_DEFAULT_")
+        return false;
+    // spec (glare) maps are sampled with the same uvs, which are moved into the atlas
+    if (!b.h.spec.name.empty() && b.h.spec.name != "_DEFAULT_")
+        return false;
+
+    switch (b.mat_type)
+    {
+    case MaterialType::Texture:
+    case MaterialType::TextureWithGlareMap:
+    case MaterialType::TextureWithGlareMap2:
+    case MaterialType::TextureWithDetalizationMap:
+    case MaterialType::TextureWithDetalizationMapWithoutModulation:
+    case MaterialType::TextureWithGlareMapAndMask:
+    case MaterialType::TextureWithMask:
+        break;
+    // TiledTexture repeats its texture over the block, and an atlas rect cannot wrap.
+    // Alpha and fx materials are blended differently, so they keep their own materials.
+    default:
+        return false;
+    }
+
+    // any wrapping uv has the same problem as TiledTexture
+    const float eps = 1e-3f;
+    for (auto &t : b.pmd.uvs)
+    {
+        if (t.u < -eps || t.u > 1 + eps || t.v < -eps || t.v > 1 + eps)
+            return false;
+    }
+    return true;
+}
+
+// blocks of one atlas share one material, so they must have the same parameters
+using atlas_key = std::pair<MaterialType, std::array<float, sizeof(material) / sizeof(float)>>;
+
+static atlas_key get_atlas_key(const block &b)
+{
+    atlas_key k;
+    k.first = b.mat_type;
+    memcpy(k.second.data(), &b.mat, sizeof(b.mat));
+    return k;
+}
+
+static int next_power_of_two(int x)
+{
+    int p = 1;
+    while (p < x)
+        p <<= 1;
+    return p;
+}
+
+struct atlas_texture
+{
+    const mat<uint32_t> *m = nullptr;
+    int x = 0;
+    int y = 0;
+    std::vector<block *> blocks;
+};
+
+// packs textures of the blocks into one atlas, remaps their uvs and sets one material name
+static void build_atlas(const std::vector<block *> &blocks, const std::map<std::string, mat<uint32_t>> &loaded,
+    const path &atlas_fn, const std::string &atlas_name)
+{
+    // padding around every texture, filled with its edge pixels
+    const int pad = 2;
+    const int max_size = 8192;
+
+    std::map<std::string, atlas_texture> textures;
+    for (auto b : blocks)
+    {
+        auto &t = textures[b->h.mask.name];
+        t.m = &loaded.find(b->h.mask.name)->second;
+        t.blocks.push_back(b);
+    }
+
+    // pack
+    std::vector<atlas_texture *> order;
+    int64_t area = 0;
+    int max_width = 0;
+    for (auto &[_, t] : textures)
+    {
+        order.push_back(&t);
+        area += (int64_t)(t.m->getWidth() + 2 * pad) * (t.m->getHeight() + 2 * pad);
+        max_width = std::max(max_width, t.m->getWidth() + 2 * pad);
+    }
+    std::sort(order.begin(), order.end(), [](auto a, auto b)
+    {
+        return std::make_pair(a->m->getHeight(), a->m->getWidth()) > std::make_pair(b->m->getHeight(), b->m->getWidth());
+    });
+
+    auto pack = [&order](int width, int height)
+    {
+        skyline_packer p(width, height);
+        for (auto t : order)
+        {
+            if (!p.insert(t->m->getWidth() + 2 * pad, t->m->getHeight() + 2 * pad, t->x, t->y))
+                return false;
+        }
+        return true;
+    };
+
+    int width = next_power_of_two(std::max(max_width, (int)sqrt((double)area)));
+    int height = width;
+    while (!pack(width, height))
+    {
+        if (height < width)
+            height *= 2;
+        else
+            width *= 2;
+        if (width > max_size || height > max_size)
+        {
+            std::cout << "atlas: " << atlas_name << ": textures do not fit into " << max_size << "x" << max_size << "\n";
+            return;
+        }
+    }
+
+    // copy textures, rows are bottom-up as in .bmp, so is uv.v
+    mat<uint32_t> atlas(width, height);
+    for (auto t : order)
+    {
+        int w = t->m->getWidth();
+        int h = t->m->getHeight();
+        for (int row = -pad; row < h + pad; row++)
+        {
+            for (int col = -pad; col < w + pad; col++)
+                atlas(t->y + pad + row, t->x + pad + col) = (*t->m)(std::clamp(row, 0, h - 1), std::clamp(col, 0, w - 1));
+        }
+    }
+    write_mat_bmp(atlas_fn, atlas);
+
+    // remap uvs and share one material
+    for (auto &[_, t] : textures)
+    {
+        float x = float(t.x + pad) / width;
+        float y = float(t.y + pad) / height;
+        float sx = float(t.m->getWidth()) / width;
+        float sy = float(t.m->getHeight()) / height;
+        for (auto b : t.blocks)
+        {
+            for (auto &uv : b->pmd.uvs)
+            {
+                uv.u = x + std::clamp(uv.u, 0.0f, 1.0f) * sx;
+                uv.v = y + std::clamp(uv.v, 0.0f, 1.0f) * sy;
+            }
+            b->h.mask.name = atlas_name;
+            b->material_name = atlas_name;
+        }
+    }
+
+    std::cout << "atlas: " << atlas_name << ": " << textures.size() << " textures, " << blocks.size() << " blocks -> "
+        << width << "x" << height << ", material type " << (uint32_t)blocks[0]->mat_type << ":";
+    for (auto b : blocks)
+        std::cout << " " << b->h.name;
+    std::cout << "\n";
+}
+
+void model::buildAtlas(const path &texture_dir, const path &fn)
+{
+    // textures are shared between groups
+    std::map<std::string, mat<uint32_t>> loaded;
+    std::map<std::string, bool> found;
+    auto load = [&texture_dir, &loaded, &found](const std::string &name)
+    {
+        auto i = found.find(name);
+        if (i != found.end())
+            return i->second;
+        auto tex_fn = texture_dir / (name + ".TM");
+        if (!fs::exists(tex_fn))
+        {
+            std::cout << "atlas: texture not found: " << to_printable_string(tex_fn) << "\n";
+            return found[name] = false;
+        }
+        tm_texture t;
+        t.load(buffer(read_file(tex_fn)));
+        loaded[name] = t.unpack();
+        return found[name] = true;
+    };
+
+    std::map<atlas_key, std::vector<block *>> groups;
+    for (auto &b : blocks)
+    {
+        if (!can_use_atlas(b) || !load(b.h.mask.name))
+            continue;
+        groups[get_atlas_key(b)].push_back(&b);
+    }
+    for (auto i = groups.begin(); i != groups.end();)
+    {
+        if (i->second.size() < 2)
+            i = groups.erase(i);
+        else
+            ++i;
+    }
+
+    // one atlas keeps the plain name, several are numbered
+    auto base = to_printable_string(fn.filename()) + ".atlas";
+    int n = 0;
+    for (auto &[_, g] : groups)
+    {
+        auto suffix = groups.size() == 1 ? std::string() : std::to_string(n++);
+        build_atlas(g, loaded, path(fn) += ".atlas" + suffix + texture_extension, base + suffix);
+    }
+}
@@ -26,6 +26,7 @@
 #include <math.h>
 
 #include <buffer.h>
+#include <parallel.h>
 
 //#include <Eigen/Core>
 //#include <Eigen/Dense>
@@ -268,7 +269,7 @@ void animation::segment::loadData(const buffer &b)
 std::string block::printMtl() const
 {
     std::string s;
-    s += "newmtl " + h.name + "\n";
+    s += "newmtl " + getMaterialName() + "\n";
     s += "\n";
     s += "Ka " + mat.ambient.print() + "\n";
     s += "Kd " + mat.diffuse.print() + "\n";
@@ -398,7 +399,7 @@ static processed_model_data process_block(const model_data &d)
 std::string block::printObj(int v_offset, int n_offset, int uv_offset, AxisSystem as) const
 {
     std::string s;
-    s += "usemtl " + h.name + "\n";
+    s += "usemtl " + getMaterialName() + "\n";
     s += "\n";
     s += "g " + h.name + "\n";
     s += "s 1\n"; // still unk how to use
@@ -419,7 +420,6 @@ void block::header::load(const buffer &b)
 {
     READ(b, type);
     READ_STRING(b, name);
-    name = translate(name);
     mask.load(b);
     spec.load(b);
     tex3.load(b);
@@ -441,7 +441,7 @@ void block::header::load(const buffer &b)
     READ(b, unk4);
 }
 
-void block::load(const buffer &b)
+buffer block::loadHeader(const buffer &b)
 {
     h.load(b);
 
@@ -449,7 +449,12 @@ void block::load(const buffer &b)
     //    throw std::runtime_error("model file has bad block size field (size == 0)");
 
     // data
-    buffer data = buffer(b, h.size);
+    return buffer(b, h.size);
+}
+
+void block::loadData(const buffer &data)
+{
+    h.name = translate(h.name);
 
     // we cannot process this type at the moment
     if (h.type == BlockType::ParticleEmitter)
@@ -457,12 +462,19 @@ void block::load(const buffer &b)
     if (h.type == BlockType::BitmapAlpha)
         return;
 
+    loadPayload(data);
+
+    pmd = process_block(md);
+}
+
+void block::load(const buffer &b)
+{
+    auto data = loadHeader(b);
+
     // if we have size - create new buffer
     // else - pass current
     // no copy when buffer is created before
-    loadPayload(h.size == 0 ? b : data);
-
-    pmd = process_block(md);
+    loadData(h.size == 0 ? b : data);
 }
 
 void block::loadPayload(const buffer &data)
@@ -534,15 +546,13 @@ void block::loadPayload(const buffer &data)
     for (auto &dm : damage_models)
         dm.load(data);
 
+    // not parsed until asked for, see getWindFaces()
     auto read_more_faces = [&]()
     {
         auto n_faces = md.faces.size();
         n_faces *= 6; // 7
 
-        decltype(md.faces) faces2;
-        faces2.resize(n_faces / 3);
-        for (auto &t : faces2)
-            READ(data, t);
+        wind_faces.emplace_back(data, n_faces / 3 * sizeof(face));
     };
 
     // maybe two winds anims?
@@ -575,20 +585,24 @@ void block::loadPayload(const buffer &data)
         else
         {
             // unknown end of block
-            decltype(md.faces) triangles2;
+            // skip whole uint16_t values, odd tail is an error below
             auto d = data.end() - data.index();
-            triangles2.resize(d / sizeof(face));
-            for (auto &t : triangles2)
-                READ(data, t);
-            uint16_t t;
-            while (!data.eof())
-                READ(data, t);
+            data.skip(d - d % sizeof(uint16_t));
         }
     }
     if (!data.eof() && h.size)
         throw std::logic_error(s);
 }
 
+std::vector<face> block::getWindFaces(size_t i) const
+{
+    buffer b(wind_faces.at(i));
+    std::vector<face> faces(b.size() / sizeof(face));
+    for (auto &f : faces)
+        f.load(b);
+    return faces;
+}
+
 static processed_model_data linkFaces(const processed_model_data &d)
 {
     // reference implementation by Razum: https://pastebin.com/KewhggDj
@@ -668,6 +682,55 @@ void block::linkFaces()
     pmd = ::linkFaces(pmd);
 }
 
+// FNV-1a
+static void hash_bytes(uint64_t &h, const void *data, size_t size)
+{
+    auto p = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+}
+
+// bytes hash() is computed from, equal for identical blocks
+std::string block::hashedData() const
+{
+    std::string s;
+    auto add = [&s](const void *data, size_t size)
+    {
+        s.append((const char *)data, size);
+    };
+    auto add_vector = [&add](const auto &v)
+    {
+        uint64_t n = v.size();
+        add(&n, sizeof(n));
+        add(v.data(), v.size() * sizeof(v[0]));
+    };
+    for (auto &v : pmd.vertices)
+        add(&v, sizeof(aim_vector3f)); // w is not used
+    add_vector(pmd.normals);
+    add_vector(pmd.uvs);
+    add_vector(pmd.faces);
+    add(&mat, sizeof(mat));
+    add(&mat_type, sizeof(mat_type));
+    add(h.mask.name.c_str(), h.mask.name.size() + 1);
+    add(h.spec.name.c_str(), h.spec.name.size() + 1);
+    return s;
+}
+
+uint64_t block::hash(const std::string &data)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    hash_bytes(h, data.data(), data.size());
+    return h;
+}
+
+uint64_t block::hash() const
+{
+    return hash(hashedData());
+}
+
 bool block::isEngineFx() const
 {
     return h.type == BlockType::HelperObject && h.name.find(boost::to_lower_copy(std::string("FIRE"))) == 0;
@@ -700,7 +763,7 @@ bool block::canPrint() const
     return false;
 }
 
-block::block_info block::save(yaml root) const
+block::block_info block::getBoundingBox() const
 {
     aim_vector4 min{ 1e6, 1e6, 1e6, 1e6 }, max{ -1e6, -1e6, -1e6, -1e6 };
     for (auto &v : md.vertices)
@@ -715,6 +778,12 @@ block::block_info block::save(yaml root) const
         mm(min, [](auto x, auto y) {return std::min(x,y); });
         mm(max, [](auto x, auto y) {return std::max(x,y); });
     }
+    return {min,max};
+}
+
+block::block_info block::save(yaml root) const
+{
+    auto [min, max] = getBoundingBox();
 
     root["xlen"] = max.x - min.x;
     root["ylen"] = max.y - min.y;
@@ -738,6 +807,189 @@ block::block_info block::save(yaml root) const
     return {min,max};
 }
 
+static uint16_t quantize16(float v, float min, float max)
+{
+    if (max <= min)
+        return 0;
+    auto q = (v - min) / (max - min) * 65535.0f + 0.5f;
+    return (uint16_t)std::clamp(q, 0.0f, 65535.0f);
+}
+
+static float dequantize16(uint16_t q, float min, float max)
+{
+    return min + q / 65535.0f * (max - min);
+}
+
+static int16_t to_snorm16(float v)
+{
+    return (int16_t)std::round(std::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+static float sign_not_zero(float v)
+{
+    return v >= 0 ? 1.0f : -1.0f;
+}
+
+// octahedral normal encoding
+// http://jcgt.org/published/0003/02/01/
+static void oct_encode(const aim_vector3f &n, int16_t out[2])
+{
+    auto len = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (len == 0)
+    {
+        out[0] = out[1] = 0;
+        return;
+    }
+    float x = n.x / len;
+    float y = n.y / len;
+    if (n.z < 0)
+    {
+        auto ox = (1 - fabs(y)) * sign_not_zero(x);
+        auto oy = (1 - fabs(x)) * sign_not_zero(y);
+        x = ox;
+        y = oy;
+    }
+    out[0] = to_snorm16(x);
+    out[1] = to_snorm16(y);
+}
+
+static aim_vector3f oct_decode(const int16_t in[2])
+{
+    aim_vector3f v;
+    v.x = std::max(in[0] / 32767.0f, -1.0f);
+    v.y = std::max(in[1] / 32767.0f, -1.0f);
+    v.z = 1 - fabs(v.x) - fabs(v.y);
+    if (v.z < 0)
+    {
+        auto x = v.x;
+        v.x = (1 - fabs(v.y)) * sign_not_zero(x);
+        v.y = (1 - fabs(x)) * sign_not_zero(v.y);
+    }
+    auto len = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    v.x /= len;
+    v.y /= len;
+    v.z /= len;
+    return v;
+}
+
+quantized_model_data block::quantize() const
+{
+    quantized_model_data q;
+
+    auto [min, max] = getBoundingBox();
+    q.min = min;
+    q.max = max;
+
+    // build single index stream
+    std::unordered_map<uint64_t, uint32_t> remap;
+    std::vector<processed_model_data::face::point> points;
+    std::vector<uint32_t> indices;
+    indices.reserve(pmd.faces.size() * 3);
+    for (auto &f : pmd.faces)
+    {
+        for (auto &p : f.points)
+        {
+            uint64_t key = ((uint64_t)p.vertex << 32) | ((uint64_t)p.normal << 16) | p.uv;
+            auto [i, inserted] = remap.emplace(key, (uint32_t)points.size());
+            if (inserted)
+                points.push_back(p);
+            indices.push_back(i->second);
+        }
+    }
+
+    q.uv_min[0] = q.uv_min[1] = 0;
+    q.uv_max[0] = q.uv_max[1] = 0;
+    if (!points.empty())
+    {
+        q.uv_min[0] = q.uv_max[0] = pmd.uvs[points[0].uv].u;
+        q.uv_min[1] = q.uv_max[1] = pmd.uvs[points[0].uv].v;
+    }
+    for (auto &p : points)
+    {
+        auto &t = pmd.uvs[p.uv];
+        q.uv_min[0] = std::min(q.uv_min[0], t.u);
+        q.uv_min[1] = std::min(q.uv_min[1], t.v);
+        q.uv_max[0] = std::max(q.uv_max[0], t.u);
+        q.uv_max[1] = std::max(q.uv_max[1], t.v);
+    }
+
+    q.positions.reserve(points.size() * 3);
+    q.normals.reserve(points.size() * 2);
+    q.uvs.reserve(points.size() * 2);
+    for (auto &p : points)
+    {
+        auto &v = pmd.vertices[p.vertex];
+        uint16_t pos[3] = {
+            quantize16(v.x, q.min.x, q.max.x),
+            quantize16(v.y, q.min.y, q.max.y),
+            quantize16(v.z, q.min.z, q.max.z),
+        };
+        q.positions.insert(q.positions.end(), pos, pos + 3);
+        q.err.position = std::max({ q.err.position,
+            fabs(dequantize16(pos[0], q.min.x, q.max.x) - v.x),
+            fabs(dequantize16(pos[1], q.min.y, q.max.y) - v.y),
+            fabs(dequantize16(pos[2], q.min.z, q.max.z) - v.z),
+        });
+
+        auto &n = pmd.normals[p.normal];
+        int16_t oct[2];
+        oct_encode(n, oct);
+        q.normals.insert(q.normals.end(), oct, oct + 2);
+        if (auto len = sqrt(n.x * n.x + n.y * n.y + n.z * n.z); len > 0)
+        {
+            auto d = oct_decode(oct);
+            auto cos_a = std::clamp((d.x * n.x + d.y * n.y + d.z * n.z) / len, -1.0f, 1.0f);
+            q.err.normal = std::max(q.err.normal, float(acos(cos_a) * 180.0 / 3.14159265358979323846));
+        }
+
+        auto &t = pmd.uvs[p.uv];
+        uint16_t tex[2] = {
+            quantize16(t.u, q.uv_min[0], q.uv_max[0]),
+            quantize16(t.v, q.uv_min[1], q.uv_max[1]),
+        };
+        q.uvs.insert(q.uvs.end(), tex, tex + 2);
+        q.err.uv = std::max({ q.err.uv,
+            fabs(dequantize16(tex[0], q.uv_min[0], q.uv_max[0]) - t.u),
+            fabs(dequantize16(tex[1], q.uv_min[1], q.uv_max[1]) - t.v),
+        });
+    }
+
+    // indices: delta to previous, zigzag, LEB128 varint
+    int32_t prev = 0;
+    for (auto i : indices)
+    {
+        int32_t d = (int32_t)i - prev;
+        prev = (int32_t)i;
+        uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+        while (z >= 0x80)
+        {
+            q.indices.push_back(uint8_t(z | 0x80));
+            z >>= 7;
+        }
+        q.indices.push_back(uint8_t(z));
+    }
+    q.n_indices = indices.size();
+
+    return q;
+}
+
+void quantized_model_data::write(buffer &b) const
+{
+    b.write(min);
+    b.write(max);
+    b.write(uv_min);
+    b.write(uv_max);
+    uint32_t n_vertices = positions.size() / 3;
+    b.write(n_vertices);
+    b.write(positions.data(), positions.size());
+    b.write(normals.data(), normals.size());
+    b.write(uvs.data(), uvs.size());
+    uint32_t n_bytes = indices.size();
+    b.write(n_indices);
+    b.write(n_bytes);
+    b.write(indices.data(), n_bytes);
+}
+
 void model::load(const buffer &b)
 {
     int n_blocks;
@@ -747,14 +999,35 @@ void model::load(const buffer &b)
     char header[0x40];
     READ(b, header);
     blocks.resize(n_blocks);
-    for (auto &f : blocks)
-        f.load(b);
+
+    // headers go one by one: the next block starts after the previous payload
+    std::vector<buffer> payloads(n_blocks);
+    std::vector<size_t> deferred;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        auto &f = blocks[i];
+        payloads[i] = f.loadHeader(b);
+        // no size - payload is read from the main stream right here
+        if (f.h.size == 0)
+            f.loadData(b);
+        else
+            deferred.push_back(i);
+    }
+
+    // payloads are independent
+    parallel_for(deferred.size(), [this, &payloads, &deferred](size_t i)
+    {
+        auto j = deferred[i];
+        blocks[j].loadData(payloads[j]);
+    });
 }
 
 void model::linkFaces()
 {
-    for (auto &f : blocks)
-        f.linkFaces();
+    parallel_for(blocks.size(), [this](size_t i)
+    {
+        blocks[i].linkFaces();
+    });
 }
 
 void model::print(const std::string &fn, AxisSystem as) const
@@ -769,34 +1042,105 @@ void model::print(const std::string &fn, AxisSystem as) const
 
     auto print_obj = [&](const auto &n)
     {
-        std::ofstream o(n);
-        title(o);
-        o << "mtllib " + fn + ".mtl\n\n";
-        o << "o " << fn << "\n\n";
+        struct obj_block
+        {
+            const block *b;
+            int v_offset;
+            int n_offset;
+            int uv_offset;
+            std::string s;
+        };
+
+        // offsets are known upfront, so blocks are formatted in parallel
+        std::vector<obj_block> objs;
         int v_offset = 0;
         int n_offset = 0;
         int uv_offset = 0;
         for (auto &b : blocks)
         {
-            if (!b.canPrint())
+            if (!b.canPrint() || b.isInstance())
                 continue;
 
-            o << b.printObj(v_offset, n_offset, uv_offset, as) << "\n";
+            objs.push_back({ &b, v_offset, n_offset, uv_offset, {} });
             v_offset += b.pmd.vertices.size();
             n_offset += b.pmd.normals.size();
             uv_offset += b.pmd.uvs.size();
         }
+        parallel_for(objs.size(), [&objs, as](size_t i)
+        {
+            auto &ob = objs[i];
+            ob.s = ob.b->printObj(ob.v_offset, ob.n_offset, ob.uv_offset, as);
+        });
+
+        std::ofstream o(n);
+        title(o);
+        o << "mtllib " + fn + ".mtl\n\n";
+        o << "o " << fn << "\n\n";
+        for (auto &ob : objs)
+            o << ob.s << "\n";
     };
 
     auto mtl_fn = fn + ".mtl";
     std::ofstream m(mtl_fn);
     title(m);
+    std::set<std::string> materials;
     for (auto &b : blocks)
-        m << b.printMtl() << "\n";
+    {
+        if (materials.insert(b.getMaterialName()).second)
+            m << b.printMtl() << "\n";
+    }
 
     print_obj(fn + ".obj");
 }
 
+void model::printQuantized(const std::string &fn) const
+{
+    auto write_string = [](buffer &b, const std::string &s)
+    {
+        uint32_t len = s.size();
+        b.write(len);
+        b.write(s.data(), len);
+    };
+
+    std::vector<const block *> printable;
+    for (auto &b : blocks)
+    {
+        if (b.canPrint() && !b.isInstance())
+            printable.push_back(&b);
+    }
+    std::vector<quantized_model_data> qs(printable.size());
+    parallel_for(printable.size(), [&printable, &qs](size_t i)
+    {
+        qs[i] = printable[i]->quantize();
+    });
+
+    uint32_t version = 1;
+    uint32_t n_blocks = printable.size();
+
+    buffer out;
+    out.write("QMSH", 4);
+    out.write(version);
+    out.write(n_blocks);
+    for (size_t i = 0; i < printable.size(); i++)
+    {
+        auto &b = *printable[i];
+        auto &q = qs[i];
+        write_string(out, b.h.name);
+        write_string(out, b.mat_type == MaterialType::MaterialOnly ? "_DEFAULT_" : b.h.mask.name);
+        q.write(out);
+
+        auto n_vertices = q.positions.size() / 3;
+        auto raw_size = n_vertices * (sizeof(aim_vector4) + sizeof(vertex_normal) + sizeof(uv)) + q.n_indices * sizeof(uint16_t);
+        auto packed_size = n_vertices * 7 * sizeof(uint16_t) + q.indices.size();
+        std::cout << "qmesh: " << b.h.name
+            << ": position error <= " << q.err.position
+            << ", normal error <= " << q.err.normal << " deg"
+            << ", uv error <= " << q.err.uv
+            << ", size " << raw_size << " -> " << packed_size << " bytes\n";
+    }
+    writeFile(fn + ".qmesh", out.buf());
+}
+
 void model::save(yaml root) const
 {
     aim_vector4 min{ 1e6, 1e6, 1e6, 1e6 }, max{ -1e6, -1e6, -1e6, -1e6 };
@@ -21,6 +21,7 @@
 #include "types.h"
 
 //#include <Eigen/Dense>
+#include <primitives/filesystem.h>
 #include <primitives/yaml.h>
 
 #include <stdint.h>
@@ -187,6 +188,33 @@ struct processed_model_data
     std::string print(int v_offset, int n_offset, int uv_offset, AxisSystem as) const;
 };
 
+// compact vertex streams for runtime export (.qmesh)
+struct quantized_model_data
+{
+    struct error_bounds
+    {
+        float position = 0; // max abs error, model units
+        float normal = 0; // max angle error, degrees
+        float uv = 0; // max abs error
+    };
+
+    aim_vector3f min;
+    aim_vector3f max;
+    float uv_min[2];
+    float uv_max[2];
+
+    // single index stream: one entry per unique (vertex, normal, uv) triple
+    std::vector<uint16_t> positions; // xyz, quantized against [min, max]
+    std::vector<int16_t> normals; // octahedral snorm16
+    std::vector<uint16_t> uvs; // quantized against [uv_min, uv_max]
+    std::vector<uint8_t> indices; // delta + zigzag + varint encoded
+    uint32_t n_indices = 0;
+
+    error_bounds err;
+
+    void write(buffer &b) const;
+};
+
 struct animation
 {
     // +1 +0.5 -0.5 +1
@@ -333,6 +361,9 @@ struct block
     std::vector<animation> animations;
     std::vector<damage_model> damage_models;
 
+    // extra face lists (wind animation?), kept as views into the file
+    std::vector<buffer> wind_faces;
+
     // unk
     uint32_t unk7;
     float unk9;
@@ -342,18 +373,39 @@ struct block
     uint32_t unk12;
 
     void load(const buffer &b);
+    // returns payload view, b is moved past it
+    buffer loadHeader(const buffer &b);
+    // name translation, payload and processing, independent of other blocks
+    void loadData(const buffer &data);
     void loadPayload(const buffer &b);
     void linkFaces();
+    std::vector<face> getWindFaces(size_t i) const;
 
     std::string printMtl() const;
     std::string printObj(int v_offset, int n_offset, int uv_offset, AxisSystem as) const;
     block_info save(yaml root) const;
+    block_info getBoundingBox() const;
+    quantized_model_data quantize() const;
 
     bool canPrint() const;
     bool isEngineFx() const;
+    bool isInstance() const { return !instance_of.empty(); }
+    const std::string &getMaterialName() const { return material_name.empty() ? h.name : material_name; }
+
+    // content hash of processed geometry + material
+    uint64_t hash() const;
+    // the hashed bytes, to tell identical blocks from hash collisions
+    std::string hashedData() const;
+    // hash() of already built hashedData()
+    static uint64_t hash(const std::string &data);
 
     //
     processed_model_data pmd;
+
+    // set when an identical block was already exported ("model/block")
+    std::string instance_of;
+    // shared by several blocks (texture atlas), h.name when empty
+    std::string material_name;
 };
 
 struct model
@@ -365,6 +417,8 @@ struct model
 
     void print(const std::string &fn, AxisSystem) const;
     void printFbx(const std::string &fn, AxisSystem) const;
+    void printQuantized(const std::string &fn) const;
+    void buildAtlas(const path &texture_dir, const path &fn);
     void save(yaml root) const;
 };
 
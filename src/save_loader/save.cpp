@@ -88,8 +88,9 @@ void string_segment::load(const buffer &b)
 
 void screen_segment::load(const buffer &b)
 {
-    b._read((uint8_t *)screenshot.getData().data(), screenshot.getBytesLength());
+    b._read((uint8_t *)screenshot.getRow(0), screenshot.getBytesLength());
     // rows should be swapped now: bottom is the first row etc.
+    // (as in .bmp, use screenshot.view().flipped() for top-down access)
 }
 
 void scripts_segment::script_entry::load(const buffer &b)
@@ -0,0 +1,224 @@
+/*
+ * AIM tm_converter
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bc3_texture.h"
+
+#include <parallel.h>
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+// 2x2 box filter with rounding, odd edges are clamped
+static mat<uint32_t> half_size(mat_view<const uint32_t> in)
+{
+    int w = std::max(1, in.getWidth() / 2);
+    int h = std::max(1, in.getHeight() / 2);
+    mat<uint32_t> out(w, h);
+    parallel_for(h, [&in, &out, w](size_t row)
+    {
+        int r0 = std::min<int>(row * 2, in.getHeight() - 1);
+        int r1 = std::min<int>(row * 2 + 1, in.getHeight() - 1);
+        for (int col = 0; col < w; col++)
+        {
+            int c0 = std::min(col * 2, in.getWidth() - 1);
+            int c1 = std::min(col * 2 + 1, in.getWidth() - 1);
+            const color *p[] = { (const color *)&in(r0, c0), (const color *)&in(r0, c1), (const color *)&in(r1, c0), (const color *)&in(r1, c1) };
+            color r;
+            for (int i = 0; i < 4; i++)
+                r.byte[i] = (p[0]->byte[i] + p[1]->byte[i] + p[2]->byte[i] + p[3]->byte[i] + 2) / 4;
+            out(row, col) = r;
+        }
+    });
+    return out;
+}
+
+void bc3_texture::add_level(mat_view<const uint32_t> image)
+{
+    levels.push_back({ image.getWidth(), image.getHeight(), encoder.encode(image) });
+}
+
+void bc3_texture::build(const tm_texture &t, bool mips)
+{
+    // unpack() returns bmp rows (bottom-up), blocks are top-down
+    // dxt5 textures are decoded only to build mips
+    if (!t.dxt5_flag)
+    {
+        auto image = t.unpack();
+        return build(image.view().flipped(), mips);
+    }
+
+    levels.clear();
+    levels.push_back({ t.width, t.height, t.d.blocks });
+    if (mips)
+    {
+        auto image = t.unpack();
+        add_mips(image.view().flipped());
+    }
+}
+
+void bc3_texture::build(mat_view<const uint32_t> image, bool mips)
+{
+    levels.clear();
+    add_level(image);
+    if (mips)
+        add_mips(image);
+}
+
+void bc3_texture::add_mips(mat_view<const uint32_t> image)
+{
+    mat<uint32_t> m(image);
+    while (m.getWidth() > 1 || m.getHeight() > 1)
+    {
+        m = half_size(m.view());
+        add_level(m.view());
+    }
+}
+
+void bc3_texture::write_dds(const path &fn) const
+{
+    struct dds_pixelformat
+    {
+        uint32_t size = sizeof(dds_pixelformat);
+        uint32_t flags = 0x4; // DDPF_FOURCC
+        char fourcc[4] = { 'D', 'X', 'T', '5' };
+        uint32_t rgb_bit_count = 0;
+        uint32_t masks[4] = { 0 };
+    };
+    struct dds_header
+    {
+        uint32_t size = sizeof(dds_header);
+        uint32_t flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000; // CAPS, HEIGHT, WIDTH, PIXELFORMAT, LINEARSIZE
+        uint32_t height;
+        uint32_t width;
+        uint32_t linear_size;
+        uint32_t depth = 0;
+        uint32_t mip_map_count;
+        uint32_t reserved1[11] = { 0 };
+        dds_pixelformat pf;
+        uint32_t caps = 0x1000; // TEXTURE
+        uint32_t caps2 = 0;
+        uint32_t caps3 = 0;
+        uint32_t caps4 = 0;
+        uint32_t reserved2 = 0;
+    };
+    static_assert(sizeof(dds_header) == 124);
+
+    if (levels.empty())
+        return;
+    dds_header h;
+    h.width = levels[0].width;
+    h.height = levels[0].height;
+    h.linear_size = levels[0].blocks.size() * sizeof(dxt5_block);
+    h.mip_map_count = levels.size();
+    if (levels.size() > 1)
+    {
+        h.flags |= 0x20000; // MIPMAPCOUNT
+        h.caps |= 0x400000 | 0x8; // MIPMAP, COMPLEX
+    }
+
+    auto f = primitives::filesystem::fopen(fn, "wb");
+    if (f == nullptr)
+        return;
+    fwrite("DDS ", 4, 1, f);
+    fwrite(&h, sizeof(h), 1, f);
+    for (auto &l : levels)
+        fwrite(l.blocks.data(), l.blocks.size() * sizeof(dxt5_block), 1, f);
+    fclose(f);
+}
+
+// https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+void bc3_texture::write_ktx2(const path &fn) const
+{
+    if (levels.empty())
+        return;
+
+    const uint8_t identifier[] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    const uint32_t vk_format_bc3_unorm_block = 137;
+    auto align = [](uint64_t v, uint64_t a) { return (v + a - 1) / a * a; };
+
+    // basic data format descriptor with two samples: alpha and color halves of the block
+    const uint32_t dfd[] =
+    {
+        60, // total size
+        0, // vendor id, descriptor type
+        2 | 56 << 16, // version, block size
+        130 | 1 << 8 | 1 << 16, // KHR_DF_MODEL_BC3, BT709 primaries, linear transfer, straight alpha
+        3 | 3 << 8, // 4x4x1x1 texels
+        16, // bytes in plane 0
+        0,
+        // alpha: bits 0..63, KHR_DF_CHANNEL_BC3_ALPHA
+        0 | 63 << 16 | 15u << 24, 0, 0, 0xFFFFFFFF,
+        // color: bits 64..127, KHR_DF_CHANNEL_BC3_COLOR
+        64 | 63 << 16 | 0 << 24, 0, 0, 0xFFFFFFFF,
+    };
+    static_assert(sizeof(dfd) == 60);
+
+    uint64_t level_index = sizeof(identifier) + 9 * sizeof(uint32_t) + 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    uint64_t dfd_offset = level_index + levels.size() * 3 * sizeof(uint64_t);
+
+    // level data is stored from the smallest level, offsets are aligned to the block size
+    std::vector<uint64_t> offsets(levels.size());
+    uint64_t offset = dfd_offset + sizeof(dfd);
+    for (int i = (int)levels.size() - 1; i >= 0; i--)
+    {
+        offset = align(offset, sizeof(dxt5_block));
+        offsets[i] = offset;
+        offset += levels[i].blocks.size() * sizeof(dxt5_block);
+    }
+
+    auto f = primitives::filesystem::fopen(fn, "wb");
+    if (f == nullptr)
+        return;
+    auto write = [f](const auto &v) { fwrite(&v, sizeof(v), 1, f); };
+    fwrite(identifier, sizeof(identifier), 1, f);
+    write(vk_format_bc3_unorm_block);
+    write(uint32_t(1)); // type size
+    write(uint32_t(levels[0].width));
+    write(uint32_t(levels[0].height));
+    write(uint32_t(0)); // depth
+    write(uint32_t(0)); // layers
+    write(uint32_t(1)); // faces
+    write(uint32_t(levels.size()));
+    write(uint32_t(0)); // supercompression
+    write(uint32_t(dfd_offset));
+    write(uint32_t(sizeof(dfd)));
+    write(uint32_t(0)); // key/value data
+    write(uint32_t(0));
+    write(uint64_t(0)); // supercompression global data
+    write(uint64_t(0));
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        uint64_t size = levels[i].blocks.size() * sizeof(dxt5_block);
+        write(offsets[i]);
+        write(size);
+        write(size);
+    }
+    fwrite(dfd, sizeof(dfd), 1, f);
+
+    uint64_t pos = dfd_offset + sizeof(dfd);
+    for (int i = (int)levels.size() - 1; i >= 0; i--)
+    {
+        const uint8_t zero[sizeof(dxt5_block)] = { 0 };
+        fwrite(zero, offsets[i] - pos, 1, f);
+        auto size = levels[i].blocks.size() * sizeof(dxt5_block);
+        fwrite(levels[i].blocks.data(), size, 1, f);
+        pos = offsets[i] + size;
+    }
+    fclose(f);
+}
@@ -0,0 +1,55 @@
+/*
+ * AIM tm_converter
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <bc3.h>
+#include <dxt5.h>
+#include <mat.h>
+#include <tm.h>
+
+#include <primitives/filesystem.h>
+
+#include <vector>
+
+// BC3 (DXT5) texture with its mip chain, rows of blocks are top-down
+struct bc3_texture
+{
+    struct level
+    {
+        int width;
+        int height;
+        std::vector<dxt5_block> blocks;
+    };
+
+    std::vector<level> levels;
+    bc3_encoder encoder;
+
+    // dxt5 blocks are used as is for level 0, other textures are encoded
+    // lower levels are box filtered from the decoded level above and encoded
+    void build(const tm_texture &t, bool mips = true);
+    // image rows are top-down
+    void build(mat_view<const uint32_t> image, bool mips = true);
+
+    void write_dds(const path &fn) const;
+    void write_ktx2(const path &fn) const;
+
+private:
+    void add_level(mat_view<const uint32_t> image);
+    void add_mips(mat_view<const uint32_t> image);
+};
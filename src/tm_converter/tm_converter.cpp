@@ -16,9 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "bc3_texture.h"
+
 #include <bmp.h>
 #include <buffer.h>
-#include <dxt5.h>
+#include <parallel.h>
+#include <tm.h>
 
 #include <primitives/filesystem.h>
 #include <primitives/sw/main.h>
@@ -26,65 +29,134 @@
 #include <primitives/sw/cl.h>
 
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <stdio.h>
 #include <stdint.h>
 #include <string>
+#include <thread>
 
 using namespace std;
 
-void convert_simple(buffer &dst, const buffer &src, int width, int height)
+cl::opt<bool> benchmark("benchmark", cl::desc("measure decoding time with 1..N threads instead of converting"));
+cl::opt<bool> dds("dds", cl::desc("write .dds (bc3) instead of .bmp"));
+cl::opt<bool> ktx2("ktx2", cl::desc("write .ktx2 (bc3) instead of .bmp"));
+cl::opt<bool> no_mips("no_mips", cl::desc("do not generate mip levels for .dds and .ktx2"));
+cl::opt<bool> encode_tm("tm", cl::desc("convert .bmp files back to dxt5 .tm"));
+cl::opt<path> tm_dir("o", cl::desc("directory for .tm files written by -tm, default is next to the .bmp files"), cl::value_desc("directory"));
+cl::opt<bool> overwrite("overwrite", cl::desc("let -tm replace existing .tm files"));
+cl::opt<bool> hq("hq", cl::desc("slower, higher quality bc3 encoding (cluster fit)"));
+cl::opt<bool> print_psnr("psnr", cl::desc("print psnr of encoded textures"));
+
+bc3_encoder::quality encoder_quality()
 {
-    int size = width * height * 2;
-    for (int i = 0; i < size; i++)
-    {
-        uint8_t c;
-        READ(src, c);
-        uint8_t lo = c & 0x0F;
-        uint8_t hi = (c & 0xF0) >> 4;
-        dst.write(uint8_t((lo << 4) | lo));
-        dst.write(uint8_t((hi << 4) | hi));
-    }
+    return hq ? bc3_encoder::quality::high : bc3_encoder::quality::fast;
 }
 
-void convert(const path &fn)
+// best of several runs for every thread count, only decoding is timed:
+// the pool is started and warmed up by an untimed run first
+void run_benchmark(const path &fn)
 {
-    int width, height;
-    int dxt5_flag = 0;
-
-    buffer src(read_file(fn));
-    READ(src, width);
-    READ(src, height);
-    src.seek(0x10);
-    src._read(&dxt5_flag, 1);
-    src.seek(0x4C);
-
-    auto s = path(fn) += ".bmp";
-    mat<uint32_t> m(width, height);
-    if (dxt5_flag)
+    tm_texture t;
+    t.load(buffer(read_file(fn)));
+    std::cout << to_printable_string(fn) << ": " << t.width << "x" << t.height << (t.dxt5_flag ? " dxt5" : "") << "\n";
+
+    auto max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double t1 = 0;
+    for (size_t n = 1;; n = std::min<size_t>(n * 2, max_threads))
     {
-        dxt5 d;
-        d.width = width;
-        d.height = height;
-        d.load_blocks(src);
-        m = d.unpack_tm();
+        parallel_threads = n;
+        parallel_executor();
+        t.unpack();
+        double best = std::numeric_limits<double>::max();
+        for (int i = 0; i < 5; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto m = t.unpack();
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+            best = std::min(best, d.count());
+        }
+        if (n == 1)
+            t1 = best;
+        std::cout << "  threads: " << n << "\t" << best * 1000 << " ms\tspeedup: " << t1 / best << "\n";
+        if (n == max_threads)
+            break;
     }
-    else
+    parallel_threads = 0;
+}
+
+// X.TM.bmp written by convert() belongs to X.TM, other files get .tm instead of .bmp
+path tm_source_path(const path &fn)
+{
+    auto p = path(fn).replace_extension();
+    auto ext = to_printable_string(p.extension());
+    if (ext != ".tm" && ext != ".TM")
+        p += ".tm";
+    return p;
+}
+
+// bmp -> tm, size must be a multiple of 4
+void convert_bmp(const path &fn)
+{
+    // originals are not replaced unless asked to
+    auto src = tm_source_path(fn);
+    auto dst = tm_dir.empty() ? src : tm_dir / src.filename();
+    if (fs::exists(dst) && !overwrite)
     {
-        buffer dst2;
-        convert_simple(dst2, src, width, height);
-        dst2.reset();
-        memcpy(&m(0,0), dst2.getPtr(), dst2.size());
-        m = m.flip(); // flip tga (normal rows order) to bmp (inverse rows order)
+        std::cout << "skipping " << to_printable_string(fn) << ": " << to_printable_string(dst)
+            << " exists, use -o or -overwrite\n";
+        return;
     }
-    write_mat_bmp(s, m);
+
+    auto m = read_mat_bmp(fn);
+    if (m.getWidth() % 4 || m.getHeight() % 4)
+        throw std::runtime_error("Texture size must be a multiple of 4: " + to_printable_string(fn));
+    auto image = m.view().flipped(); // blocks are top-down
+
+    tm_texture t;
+    // keep the header bytes load() does not interpret
+    if (fs::exists(src))
+        t.load(buffer(read_file(src)));
+    t.width = t.d.width = m.getWidth();
+    t.height = t.d.height = m.getHeight();
+    t.dxt5_flag = 1;
+    t.d.blocks = bc3_encoder(encoder_quality()).encode(image);
+    if (print_psnr)
+        std::cout << to_printable_string(fn) << ": psnr " << bc3_encoder::psnr(image, t.d.blocks) << " dB\n";
+    if (!tm_dir.empty())
+        fs::create_directories(tm_dir);
+    t.save(dst);
+}
+
+void convert(const path &fn)
+{
+    if (encode_tm)
+        return convert_bmp(fn);
+    if (benchmark)
+        return run_benchmark(fn);
+
+    tm_texture t;
+    t.load(buffer(read_file(fn)));
+    if (!dds && !ktx2)
+        return write_mat_bmp(path(fn) += ".bmp", t.unpack());
+
+    bc3_texture bc3;
+    bc3.encoder.q = encoder_quality();
+    bc3.build(t, !no_mips);
+    if (print_psnr)
+        std::cout << to_printable_string(fn) << ": psnr " << bc3_encoder::psnr(t.unpack().view().flipped(), bc3.levels[0].blocks) << " dB\n";
+    if (dds)
+        bc3.write_dds(path(fn) += ".dds");
+    if (ktx2)
+        bc3.write_ktx2(path(fn) += ".ktx2");
 }
 
 int main(int argc, char *argv[])
 {
-    cl::opt<path> p(cl::Positional, cl::desc("<file.tm>"), cl::Required);
+    cl::opt<path> p(cl::Positional, cl::desc("<file.tm or directory, file.bmp with -tm>"), cl::Required);
 
     cl::ParseCommandLineOptions(argc, argv);
 
@@ -92,7 +164,7 @@ int main(int argc, char *argv[])
         convert(p);
     else if (fs::is_directory(p))
     {
-        auto files = enumerate_files_like(p, ".*\\.TM", false);
+        auto files = enumerate_files_like(p, encode_tm ? ".*\\.bmp" : ".*\\.TM", false);
         for (auto &f : files)
         {
             std::cout << "processing: " << to_printable_string(f) << "\n";
@@ -9,6 +9,7 @@ void build(Solution &s)
     common += cpp20;
     common.setRootDirectory("src/common");
     common.Public += "pub.egorpugin.primitives.filesystem-master"_dep;
+    common.Public += "pub.egorpugin.primitives.executor-master"_dep;
 
     auto add_exe = [&tools](const String &name) -> decltype(auto)
     {
@@ -40,6 +41,7 @@ void build(Solution &s)
     add_exe_with_common("mmp_extractor") += "org.sw.demo.intel.opencv.highgui-*"_dep;
     add_exe_with_common("mpj_loader");
     add_exe_with_common("tm_converter");
+    add_exe_with_common("color_math_check"); // exits with 1 when color_math differs from the reference
     add_exe("name_generator");
     add_exe_with_common("save_loader");
     if (common.getBuildSettings().TargetOS.Arch == ArchType::x86)